@@ -82,10 +82,11 @@ check_yesno(uint8_t default_answer)
 static void
 pkg_download(Plisthead *installhead)
 {
-	FILE		*fp;
-	Pkglist  	*pinstall;
+	Pkglist  	*pinstall, **pkgs = NULL;
 	struct stat	st;
-	Dlfile		*dlpkg;
+	struct url	*url;
+	Pkgdl		*dls = NULL;
+	int			i, ndls = 0;
 	char		pkg_fs[BUFSIZ], pkg_url[BUFSIZ], query[BUFSIZ];
 
 	printf(MSG_DOWNLOAD_PKGS);
@@ -124,28 +125,44 @@ pkg_download(Plisthead *installhead)
 			continue;
 		}
 
-		umask(DEF_UMASK);
-		if ((fp = fopen(pkg_fs, "w")) == NULL)
-			err(EXIT_FAILURE, MSG_ERR_OPEN, pkg_fs);
+		/* queued, see download_pkgs() */
+		XREALLOC(dls, (ndls + 1) * sizeof(Pkgdl));
+		XREALLOC(pkgs, (ndls + 1) * sizeof(Pkglist *));
+		memset(&dls[ndls], 0, sizeof(Pkgdl));
+		XSTRDUP(dls[ndls].url, pkg_url);
+		XSTRDUP(dls[ndls].path, pkg_fs);
+		if ((url = fetchParseURL(pkg_url)) != NULL) {
+			XSTRDUP(dls[ndls].host, url->host);
+			fetchFreeURL(url);
+		} else
+			XSTRDUP(dls[ndls].host, "");
+		dls[ndls].size = pinstall->file_size;
+		pkgs[ndls++] = pinstall;
+	} /* download loop */
+
+	umask(DEF_UMASK);
+	download_pkgs(dls, ndls);
 
-		if ((dlpkg = download_file(pkg_url, NULL)) == NULL) {
-			fprintf(stderr, MSG_PKG_NOT_AVAIL, pinstall->depend);
+	/* failures, in install order */
+	for (i = 0; i < ndls; i++) {
+		if (dls[i].error == DL_FAILED)
+			errx(EXIT_FAILURE, "%s", dls[i].errmsg);
+
+		if (dls[i].error == DL_UNAVAIL) {
+			fprintf(stderr, MSG_PKG_NOT_AVAIL, pkgs[i]->depend);
 			if (!check_yesno(DEFAULT_NO))
 				errx(EXIT_FAILURE, MSG_PKG_NOT_AVAIL,
-				    pinstall->depend);
-			pinstall->file_size = -1;
-			fclose(fp);
-			continue;
+				    pkgs[i]->depend);
+			pkgs[i]->file_size = -1;
 		}
 
-		fwrite(dlpkg->buf, dlpkg->size, 1, fp);
-		fclose(fp);
-
-		XFREE(dlpkg->buf);
-		XFREE(dlpkg);
-
-	} /* download loop */
+		XFREE(dls[i].url);
+		XFREE(dls[i].path);
+		XFREE(dls[i].host);
+	}
 
+	XFREE(dls);
+	XFREE(pkgs);
 }
 
 /**
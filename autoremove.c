@@ -161,6 +161,9 @@ pkg_keep(int type, char **pkgargs)
 	if (SLIST_EMPTY(&l_plisthead)) /* no packages recorded */
 		return;
 
+	/* an update running meanwhile would swap our flags away */
+	pkgindb_lock();
+
 	/* parse packages by their command line names */
 	for (pkeep = pkgargs; *pkeep != NULL; pkeep++) {
 		/* find real package name */
@@ -203,4 +206,6 @@ pkg_keep(int type, char **pkgargs)
 		} else
 			printf(MSG_PKG_NOT_INSTALLED, *pkeep);
 	} /* for (pkeep) */
+
+	pkgindb_unlock();
 }
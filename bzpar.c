@@ -0,0 +1,438 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2009, 2010 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Emile "iMil" Heitor <imil@NetBSD.org> .
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+
+/**
+ * Parallel bzip2 decoder
+ *
+ * A bzip2 stream is a header followed by blocks of at most 900k of
+ * input, each compressed on its own and starting with a 48 bits magic
+ * number. Blocks are not byte aligned: they are found by testing that
+ * magic at every bit offset, as lbzip2 does. Each one is then rewritten
+ * as a single block stream, "BZh9", the block bits, an end of stream
+ * marker and the block CRC as the combined CRC, which libbz2 decodes.
+ *
+ * The magic number may also show up in compressed data. The block CRCs
+ * found are thus folded and compared to each stream's combined CRC
+ * before anything is decoded, any mismatch and the caller falls back
+ * to the serial decoder.
+ *
+ * Blocks are decoded by worker threads, at most BZPAR_AHEAD of them per
+ * thread ahead of the reader, and returned in order by bzpar_read().
+ */
+
+#include <bzlib.h>
+#include <pthread.h>
+#include "pkgin.h"
+
+#define BZPAR_BLOCK		0x314159265359ULL /* pi */
+#define BZPAR_EOS		0x177245385090ULL /* sqrt(pi) */
+#define BZPAR_MASK		0xffffffffffffULL
+#define BZPAR_AHEAD		2
+#define BZPAR_OUT		(1024 * 1024) /* initial block output buffer */
+
+#define BLK_QUEUED		0
+#define BLK_BUSY		1
+#define BLK_DONE		2
+#define BLK_FAILED		3
+
+struct Bzblock {
+	uint64_t	start; /*!< bit offset of the block magic */
+	uint64_t	end; /*!< bit offset of the next magic */
+	uint32_t	crc;
+	int			state;
+	char		*out;
+	size_t		out_len;
+};
+
+struct Bzpar {
+	const unsigned char	*buf;
+	size_t				len;
+	struct Bzblock		*blocks;
+	int					nblocks;
+	int					next; /*!< next block to decode */
+	int					cur; /*!< next block to return */
+	int					ahead; /*!< blocks decoded ahead of cur */
+	uint8_t				quit;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	pthread_t			workers[MAX_BZIP2_WORKERS];
+	int					nworkers;
+};
+
+/* magic found at a bit offset */
+struct Bzmark {
+	uint64_t	bit;
+	uint8_t		eos;
+};
+
+/* read n <= 32 bits at bit offset pos */
+static uint32_t
+getbits(const unsigned char *buf, size_t len, uint64_t pos, int n)
+{
+	uint32_t	v = 0;
+	int			i;
+
+	for (i = 0; i < n; i++, pos++) {
+		if (pos / 8 >= len)
+			return 0;
+		v = (v << 1) | ((buf[pos / 8] >> (7 - pos % 8)) & 1);
+	}
+
+	return v;
+}
+
+/* write n <= 64 bits of v at bit offset pos */
+static void
+putbits(unsigned char *buf, uint64_t pos, uint64_t v, int n)
+{
+	for (n--; n >= 0; n--, pos++)
+		if ((v >> n) & 1)
+			buf[pos / 8] |= 0x80 >> (pos % 8);
+}
+
+static int
+valid_header(const unsigned char *p)
+{
+	return p[0] == 'B' && p[1] == 'Z' && p[2] == 'h' &&
+		p[3] >= '1' && p[3] <= '9';
+}
+
+/* every block and end of stream magic, in order */
+static struct Bzmark *
+find_marks(const unsigned char *buf, size_t len, int *count)
+{
+	struct Bzmark	*marks = NULL;
+	uint64_t		w = 0, m;
+	size_t			i, size = 0;
+	int				n = 0, k;
+
+	for (i = 0; i < len; i++) {
+		w = (w << 8) | buf[i];
+		/* 48 bits ending k bits before the end of byte i */
+		for (k = 7; k >= 0 && i >= 6; k--) {
+			m = (w >> k) & BZPAR_MASK;
+			if (m != BZPAR_BLOCK && m != BZPAR_EOS)
+				continue;
+
+			if ((size_t)n == size) {
+				size = size ? size * 2 : 64;
+				XREALLOC(marks, size * sizeof(struct Bzmark));
+			}
+			marks[n].bit = (uint64_t)(i + 1) * 8 - k - 48;
+			marks[n].eos = m == BZPAR_EOS;
+			n++;
+		}
+	}
+
+	*count = n;
+
+	return marks;
+}
+
+/*
+ * split buf to blocks, checking them against the stream layout and
+ * combined CRCs. Returns the number of blocks, 0 if buf can't be split
+ */
+static int
+split_blocks(Bzpar *bp)
+{
+	struct Bzmark	*marks;
+	uint64_t		hdr = 0; /* bit offset of the current stream header */
+	uint32_t		combined = 0;
+	int				i, nmarks, n = 0;
+
+	if (bp->len < 4 || !valid_header(bp->buf))
+		return 0;
+
+	marks = find_marks(bp->buf, bp->len, &nmarks);
+	XMALLOC(bp->blocks, (nmarks + 1) * sizeof(struct Bzblock));
+
+	for (i = 0; i < nmarks; i++) {
+		/* the first magic of a stream follows its header */
+		if ((i == 0 || marks[i - 1].eos) && marks[i].bit != hdr + 32)
+			goto fail;
+
+		if (marks[i].eos) {
+			if (getbits(bp->buf, bp->len, marks[i].bit + 48, 32)
+				!= combined)
+				goto fail;
+			combined = 0;
+			/* next stream, if any, starts on a byte boundary */
+			hdr = (marks[i].bit + 80 + 7) & ~(uint64_t)7;
+			if (hdr / 8 == bp->len)
+				break;
+			if (hdr / 8 + 4 > bp->len || !valid_header(bp->buf + hdr / 8))
+				goto fail;
+			continue;
+		}
+
+		bp->blocks[n].start = marks[i].bit;
+		bp->blocks[n].end = i + 1 < nmarks ? marks[i + 1].bit : 0;
+		bp->blocks[n].crc = getbits(bp->buf, bp->len, marks[i].bit + 48, 32);
+		combined = ((combined << 1) | (combined >> 31)) ^ bp->blocks[n].crc;
+		n++;
+	}
+
+	/* everything must have been accounted for, last stream ended */
+	if (i != nmarks - 1 || n < 2)
+		goto fail;
+
+	XFREE(marks);
+
+	return n;
+
+fail:
+	XFREE(marks);
+	XFREE(bp->blocks);
+
+	return 0;
+}
+
+/* decode block b as a standalone stream */
+static int
+decode_block(Bzpar *bp, struct Bzblock *b)
+{
+	bz_stream		bz;
+	unsigned char	*in;
+	uint64_t		nbits = b->end - b->start;
+	size_t			nbytes = (nbits + 7) / 8, in_len, size, j, base;
+	int				off, rc;
+
+	/* header, block, end of stream magic and CRC */
+	in_len = 4 + (nbits + 80 + 7) / 8;
+	XMALLOC(in, in_len);
+	memcpy(in, "BZh9", 4);
+
+	base = b->start / 8;
+	off = b->start % 8;
+	for (j = 0; j < nbytes; j++) {
+		in[4 + j] = bp->buf[base + j] << off;
+		if (off > 0 && base + j + 1 < bp->len)
+			in[4 + j] |= bp->buf[base + j + 1] >> (8 - off);
+	}
+	if (nbits % 8 != 0)
+		in[4 + nbits / 8] &= 0xff << (8 - nbits % 8);
+	putbits(in, 32 + nbits, BZPAR_EOS, 48);
+	putbits(in, 32 + nbits + 48, b->crc, 32);
+
+	memset(&bz, 0, sizeof(bz_stream));
+	if (BZ2_bzDecompressInit(&bz, 0, 0) != BZ_OK) {
+		XFREE(in);
+		return 0;
+	}
+	bz.next_in = (char *)in;
+	bz.avail_in = in_len;
+
+	size = BZPAR_OUT;
+	XMALLOC(b->out, size);
+	b->out_len = 0;
+
+	for (;;) {
+		if (b->out_len == size) {
+			size *= 2;
+			XREALLOC(b->out, size);
+		}
+		bz.next_out = b->out + b->out_len;
+		bz.avail_out = size - b->out_len;
+
+		rc = BZ2_bzDecompress(&bz);
+		b->out_len = size - bz.avail_out;
+
+		if (rc == BZ_STREAM_END)
+			break;
+		/* the whole stream is there, no progress is an error */
+		if (rc != BZ_OK || (bz.avail_in == 0 && bz.avail_out > 0))
+			break;
+	}
+
+	BZ2_bzDecompressEnd(&bz);
+	XFREE(in);
+
+	return rc == BZ_STREAM_END;
+}
+
+static void *
+bzpar_worker(void *arg)
+{
+	Bzpar			*bp = arg;
+	struct Bzblock	*b;
+	int				ok;
+
+	pthread_mutex_lock(&bp->lock);
+	for (;;) {
+		while (!bp->quit && bp->next < bp->nblocks &&
+			bp->next >= bp->cur + bp->ahead)
+			pthread_cond_wait(&bp->cond, &bp->lock);
+
+		if (bp->quit || bp->next == bp->nblocks)
+			break;
+
+		b = &bp->blocks[bp->next++];
+		b->state = BLK_BUSY;
+		pthread_mutex_unlock(&bp->lock);
+
+		ok = decode_block(bp, b);
+
+		pthread_mutex_lock(&bp->lock);
+		b->state = ok ? BLK_DONE : BLK_FAILED;
+		pthread_cond_broadcast(&bp->cond);
+	}
+	pthread_mutex_unlock(&bp->lock);
+
+	return NULL;
+}
+
+/**
+ * \fn bzpar_open
+ *
+ * \brief decode the bzip2 data in buf with nworkers threads
+ *
+ * buf must stay valid until bzpar_close(). Returns NULL if buf can't be
+ * split to blocks, it is then left to the serial decoder.
+ */
+Bzpar *
+bzpar_open(const char *buf, size_t len, int nworkers)
+{
+	Bzpar	*bp;
+	int		i;
+
+	XMALLOC(bp, sizeof(Bzpar));
+	bp->buf = (const unsigned char *)buf;
+	bp->len = len;
+
+	if ((bp->nblocks = split_blocks(bp)) == 0) {
+		XFREE(bp);
+		return NULL;
+	}
+
+	if (nworkers > MAX_BZIP2_WORKERS)
+		nworkers = MAX_BZIP2_WORKERS;
+	bp->ahead = BZPAR_AHEAD * nworkers;
+
+	pthread_mutex_init(&bp->lock, NULL);
+	pthread_cond_init(&bp->cond, NULL);
+
+	for (i = 0; i < nworkers; i++) {
+		if (pthread_create(&bp->workers[i], NULL, bzpar_worker, bp) != 0)
+			break;
+		bp->nworkers++;
+	}
+
+	if (bp->nworkers == 0) {
+		bzpar_close(bp);
+		return NULL;
+	}
+
+	return bp;
+}
+
+/**
+ * \fn bzpar_read
+ *
+ * \brief next decoded block, valid until the next call
+ *
+ * Returns 1, 0 at end of data or -1 if a block failed to decode.
+ */
+int
+bzpar_read(Bzpar *bp, char **out, size_t *out_len)
+{
+	struct Bzblock	*b;
+
+	pthread_mutex_lock(&bp->lock);
+
+	/* previous block was consumed */
+	if (bp->cur > 0)
+		XFREE(bp->blocks[bp->cur - 1].out);
+
+	if (bp->cur == bp->nblocks) {
+		pthread_mutex_unlock(&bp->lock);
+		return 0;
+	}
+
+	b = &bp->blocks[bp->cur];
+	while (b->state != BLK_DONE && b->state != BLK_FAILED)
+		pthread_cond_wait(&bp->cond, &bp->lock);
+
+	bp->cur++;
+	pthread_cond_broadcast(&bp->cond);
+	pthread_mutex_unlock(&bp->lock);
+
+	if (b->state == BLK_FAILED)
+		return -1;
+
+	*out = b->out;
+	*out_len = b->out_len;
+
+	return 1;
+}
+
+/**
+ * \fn bzpar_done
+ *
+ * \brief compressed bytes returned by bzpar_read() so far
+ */
+off_t
+bzpar_done(Bzpar *bp)
+{
+	if (bp->cur == 0)
+		return 0;
+	if (bp->cur == bp->nblocks)
+		return bp->len;
+
+	return bp->blocks[bp->cur].start / 8;
+}
+
+void
+bzpar_close(Bzpar *bp)
+{
+	int	i;
+
+	if (bp == NULL)
+		return;
+
+	pthread_mutex_lock(&bp->lock);
+	bp->quit = 1;
+	pthread_cond_broadcast(&bp->cond);
+	pthread_mutex_unlock(&bp->lock);
+
+	for (i = 0; i < bp->nworkers; i++)
+		pthread_join(bp->workers[i], NULL);
+
+	pthread_mutex_destroy(&bp->lock);
+	pthread_cond_destroy(&bp->cond);
+
+	for (i = 0; i < bp->nblocks; i++)
+		XFREE(bp->blocks[i].out);
+	XFREE(bp->blocks);
+	XFREE(bp);
+}
@@ -82,6 +82,8 @@ static struct command {
 	  PKG_SHPKGDESC_CMD },
 	{ "pkg-build-defs", "pbd", "Show remote package's build definitions.",
 	  PKG_SHPKGBDEFS_CMD },
+	{ "catalog", "ca", "Write the packages database of a repository to file.",
+	  PKG_CATALOG_CMD },
 	{ "tonic", "to", "Gin Tonic recipe.",
 	  PKG_GINTO_CMD },
 	{ NULL, NULL, NULL, 0 }
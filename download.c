@@ -30,35 +30,123 @@
  *
  */
 
+#include <sys/socket.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include "pkgin.h"
 #include "progressmeter.h"
 
 int		fetchTimeout = 15; /* wait 15 seconds before timeout */
 size_t	fetch_buffer = 1024;
 
-/* if db_mtime == NULL, we're downloading a package, pkg_summary otherwise */
-Dlfile *
-download_file(char *str_url, time_t *db_mtime)
+/* Pkgdl states */
+#define DL_QUEUED	0
+#define DL_RUNNING	1
+#define DL_DONE		2
+
+/**
+ * \struct Dlpool
+ * \brief package downloads, picked in order by the workers within the
+ * per-host limit
+ */
+static struct Dlpool {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	Pkgdl			*dls;
+	int				ndls;
+	int				queued; /*!< not picked yet */
+	int				host_max; /*!< running downloads per host */
+	int				done; /*!< finished downloads */
+	uint8_t			threaded; /*!< downloads run from worker threads */
+	off_t			fetched; /*!< bytes */
+	off_t			shown; /*!< fetched, as copied for the progress meter */
+} dlpool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/*
+ * libfetch keeps its last error in globals, which concurrent requests
+ * overwrite. Summary requests aren't serialized for it: a network
+ * failure is only taken from them when this thread's errno agrees, see
+ * fetch_errcode(), and unreachable hosts are found by fetch_reachable()
+ * beforehand. Package downloads leave it unread, and never run along
+ * with summary fetches, see download_pkgs().
+ */
+
+/* libfetch error code of this thread's failed request, best effort */
+static int
+fetch_errcode(void)
+{
+	int	code = fetchLastErrCode;
+
+	switch (code) {
+	case FETCH_DOWN:
+	case FETCH_NETWORK:
+	case FETCH_TIMEOUT:
+		/* set from errno by fetch_syserr(), or another request's */
+		switch (errno) {
+		case ECONNREFUSED:
+		case ECONNRESET:
+		case EHOSTDOWN:
+		case EHOSTUNREACH:
+		case ENETDOWN:
+		case ENETRESET:
+		case ENETUNREACH:
+		case ETIMEDOUT:
+			return code;
+		}
+		return FETCH_UNKNOWN;
+	}
+
+	return code;
+}
+
+/**
+ * \fn fetch_url
+ *
+ * \brief open str_url and check its modification time
+ *
+ * if db_mtime == NULL, we're downloading a package, pkg_summary otherwise.
+ * *size is set to the remote file size, -1 if unknown. On failure, the
+ * libfetch error code is copied to *errcode if not NULL.
+ */
+fetchIO *
+fetch_url(char *str_url, time_t *db_mtime, off_t *size, int *errcode)
 {
 	/* from pkg_install/files/admin/audit.c */
-	Dlfile			*file;
-	char			*p;
-	size_t			buf_len, buf_fetched;
-	ssize_t			cur_fetched;
-	off_t			statsize;
-	time_t			begin_dl, now;
 	struct url_stat	st;
 	struct url		*url;
 	fetchIO			*f = NULL;
+	int				code;
 
-	url = fetchParseURL(str_url);
+	if (errcode != NULL)
+		*errcode = 0;
 
-	if (url == NULL || (f = fetchXGet(url, &st, "")) == NULL)
+	if ((url = fetchParseURL(str_url)) == NULL)
 		return NULL;
 
-	if (st.size == -1) { /* could not obtain file size */
-		if (db_mtime != NULL) /* we're downloading pkg_summary */
-			*db_mtime = 0; /* not -1, don't force update */
+	errno = 0;
+
+	/* conditional request (If-Modified-Since) when we have a copy */
+	if (db_mtime != NULL && *db_mtime > 0) {
+		url->last_modified = *db_mtime;
+		f = fetchXGet(url, &st, "i");
+	} else
+		f = fetchXGet(url, &st, "");
+
+	if (f == NULL) {
+		if (errcode == NULL && db_mtime == NULL)
+			return NULL;
+
+		code = fetch_errcode();
+		if (errcode != NULL)
+			*errcode = code;
+
+		/* 304 Not Modified */
+		if (db_mtime != NULL && code == FETCH_UNCHANGED)
+			*db_mtime = -1;
 
 		return NULL;
 	}
@@ -76,6 +164,146 @@ download_file(char *str_url, time_t *db_mtime)
 		*db_mtime = st.mtime;
 	}
 
+	*size = st.size;
+
+	return f;
+}
+
+/* connect() to ai within PROBE_TIMEOUT seconds */
+static int
+probe_connect(struct addrinfo *ai)
+{
+	struct pollfd	pfd;
+	socklen_t		len = sizeof(int);
+	int				s, error = -1;
+
+	if ((s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+		return 0;
+
+	if (fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK) == 0) {
+		if (connect(s, ai->ai_addr, ai->ai_addrlen) == 0)
+			error = 0;
+		else if (errno == EINPROGRESS) {
+			pfd.fd = s;
+			pfd.events = POLLOUT;
+			if (poll(&pfd, 1, PROBE_TIMEOUT * 1000) == 1 &&
+				getsockopt(s, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+				error = -1;
+		}
+	}
+
+	close(s);
+
+	return error == 0;
+}
+
+/**
+ * \fn fetch_reachable
+ *
+ * \brief check that str_url's host accepts a connection within
+ * PROBE_TIMEOUT seconds, so an unreachable repository isn't waited for
+ * fetchTimeout. Nothing from libfetch, this runs from the fetch
+ * workers. 1 when it can't tell: not a network URL, or a proxy is used.
+ */
+int
+fetch_reachable(const char *str_url)
+{
+	static const char *const	proxies[] = {
+		"HTTP_PROXY", "http_proxy", "HTTPS_PROXY", "https_proxy",
+		"FTP_PROXY", "ftp_proxy", NULL
+	};
+	static const struct {
+		const char	*scheme;
+		const char	*port;
+	} schemes[] = {
+		{ "http", "80" }, { "https", "443" }, { "ftp", "21" }, { NULL, NULL }
+	};
+	struct addrinfo	hints, *res, *ai;
+	const char		*p, *host, *port, *end;
+	char			hostbuf[BUFSIZ], portbuf[SMLLEN];
+	size_t			len;
+	int				i, reachable = 0;
+
+	for (i = 0; proxies[i] != NULL; i++)
+		if ((p = getenv(proxies[i])) != NULL && *p != '\0')
+			return 1;
+
+	if ((p = strstr(str_url, "://")) == NULL)
+		return 1;
+	for (i = 0; schemes[i].scheme != NULL; i++)
+		if (strlen(schemes[i].scheme) == (size_t)(p - str_url) &&
+			strncmp(str_url, schemes[i].scheme, p - str_url) == 0)
+			break;
+	if (schemes[i].scheme == NULL)
+		return 1;
+	port = schemes[i].port;
+
+	/* [user[:password]@]host[:port], host may be an [IPv6] address */
+	host = p + 3;
+	end = host + strcspn(host, "/");
+	for (p = host; p < end; p++)
+		if (*p == '@')
+			host = p + 1;
+	if (*host == '[') {
+		host++;
+		if ((p = memchr(host, ']', end - host)) == NULL)
+			return 1;
+		len = p++ - host;
+	} else {
+		p = memchr(host, ':', end - host);
+		if (p == NULL)
+			p = end;
+		len = p - host;
+	}
+	if (p < end && *p == ':' && end - p > 1) {
+		if ((size_t)(end - p) > sizeof(portbuf))
+			return 1;
+		strlcpy(portbuf, p + 1, end - p);
+		port = portbuf;
+	}
+	if (len == 0 || len >= sizeof(hostbuf))
+		return 1;
+	strlcpy(hostbuf, host, len + 1);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(hostbuf, port, &hints, &res) != 0)
+		return 0;
+
+	for (ai = res; ai != NULL && !reachable; ai = ai->ai_next)
+		reachable = probe_connect(ai);
+
+	freeaddrinfo(res);
+
+	return reachable;
+}
+
+/* if db_mtime == NULL, we're downloading a package, pkg_summary otherwise */
+Dlfile *
+download_file(char *str_url, time_t *db_mtime)
+{
+	Dlfile			*file;
+	char			*p;
+	size_t			buf_len, buf_fetched;
+	ssize_t			cur_fetched;
+	off_t			statsize, size;
+	time_t			begin_dl, now;
+	fetchIO			*f;
+
+	if ((f = fetch_url(str_url, db_mtime, &size, NULL)) == NULL)
+		return NULL;
+
+	if (size == -1) { /* could not obtain file size */
+		if (db_mtime != NULL) /* we're downloading pkg_summary */
+			*db_mtime = 0; /* not -1, don't force update */
+
+		fetchIO_close(f);
+
+		return NULL;
+	}
+
 
 	if ((p = strrchr(str_url, '/')) != NULL)
 		p++;
@@ -84,11 +312,11 @@ download_file(char *str_url, time_t *db_mtime)
 
 #ifndef _MINIX /* XXX: SSIZE_MAX fails under MINIX */
 	/* st.size is an off_t, it will be > SSIZE_MAX on 32 bits systems */
-	if (sizeof(st.size) == sizeof(SSIZE_MAX) && st.size > SSIZE_MAX - 1)
+	if (sizeof(size) == sizeof(SSIZE_MAX) && size > SSIZE_MAX - 1)
 		err(EXIT_FAILURE, "file is too large");
 #endif
 
-	buf_len = st.size;
+	buf_len = size;
 	XMALLOC(file, sizeof(Dlfile));
 	XMALLOC(file->buf, buf_len + 1);
 
@@ -127,3 +355,249 @@ download_file(char *str_url, time_t *db_mtime)
 
 	return file;
 }
+
+/* a concurrency limit from the environment, def if unset or invalid */
+static int
+env_limit(const char *name, int def)
+{
+	char	*env, *end;
+	long	n;
+
+	if ((env = getenv(name)) == NULL)
+		return def;
+
+	n = strtol(env, &end, 10);
+	if (end == env || *end != '\0' || n < 1) {
+		warnx(MSG_INVALID_LIMIT, name, env);
+		return def;
+	}
+
+	return n > MAX_DOWNLOAD_WORKERS ? MAX_DOWNLOAD_WORKERS : (int)n;
+}
+
+/* first queued download whose host is below its limit, lock held */
+static Pkgdl *
+download_next(void)
+{
+	Pkgdl	*dl, *run;
+	int		running;
+
+	for (dl = dlpool.dls; dl < dlpool.dls + dlpool.ndls; dl++) {
+		if (dl->state != DL_QUEUED)
+			continue;
+
+		running = 0;
+		for (run = dlpool.dls; run < dlpool.dls + dlpool.ndls; run++)
+			if (run->state == DL_RUNNING &&
+				strcmp(run->host, dl->host) == 0)
+				running++;
+
+		if (running < dlpool.host_max)
+			return dl;
+	}
+
+	return NULL;
+}
+
+/**
+ * \fn download_pkg
+ *
+ * \brief write dl->url to dl->path, which is removed if the transfer
+ * fails
+ */
+static void
+download_pkg(Pkgdl *dl)
+{
+	FILE	*fp;
+	fetchIO	*f;
+	off_t	size, got = 0;
+	ssize_t	n;
+	char	buf[BUFSIZ];
+
+	/*
+	 * no error code: the other workers' requests overwrite libfetch's,
+	 * which is deliberately left unread
+	 */
+	if ((f = fetch_url(dl->url, NULL, &size, NULL)) == NULL) {
+		dl->error = DL_UNAVAIL;
+		return;
+	}
+	if (size == -1) { /* could not obtain file size */
+		fetchIO_close(f);
+		dl->error = DL_UNAVAIL;
+		return;
+	}
+
+	if ((fp = fopen(dl->path, "w")) == NULL) {
+		snprintf(dl->errmsg, BUFSIZ, MSG_ERR_OPEN": %s", dl->path,
+			strerror(errno));
+		fetchIO_close(f);
+		dl->error = DL_FAILED;
+		return;
+	}
+
+	while (got < size) {
+		n = fetchIO_read(f, buf,
+			size - got < (off_t)BUFSIZ ? (size_t)(size - got) : BUFSIZ);
+		if (n <= 0) {
+			if (n == 0)
+				snprintf(dl->errmsg, BUFSIZ, "truncated file: %s",
+					dl->url);
+			else /* fetchLastErrString may be another worker's */
+				snprintf(dl->errmsg, BUFSIZ,
+					"failure during fetch of file: %s", strerror(errno));
+			dl->error = DL_FAILED;
+			break;
+		}
+		if (fwrite(buf, 1, n, fp) != (size_t)n) {
+			snprintf(dl->errmsg, BUFSIZ, "can't write %s: %s", dl->path,
+				strerror(errno));
+			dl->error = DL_FAILED;
+			break;
+		}
+
+		got += n;
+
+		pthread_mutex_lock(&dlpool.lock);
+		dlpool.fetched += n;
+		/* this is the progress meter's thread, see download_pkgs() */
+		if (!dlpool.threaded)
+			dlpool.shown = dlpool.fetched;
+		pthread_mutex_unlock(&dlpool.lock);
+	}
+
+	fetchIO_close(f);
+
+	if (fclose(fp) != 0 && dl->error == DL_OK) {
+		snprintf(dl->errmsg, BUFSIZ, "can't write %s: %s", dl->path,
+			strerror(errno));
+		dl->error = DL_FAILED;
+	}
+	if (dl->error == DL_OK && got == 0) {
+		snprintf(dl->errmsg, BUFSIZ, "empty download: %s", dl->url);
+		dl->error = DL_FAILED;
+	}
+
+	if (dl->error != DL_OK)
+		(void)unlink(dl->path);
+}
+
+static void *
+download_worker(void *arg)
+{
+	Pkgdl	*dl;
+
+	pthread_mutex_lock(&dlpool.lock);
+	while (dlpool.queued > 0) {
+		/* every remaining one waits for a busy host */
+		if ((dl = download_next()) == NULL) {
+			pthread_cond_wait(&dlpool.cond, &dlpool.lock);
+			continue;
+		}
+
+		dl->state = DL_RUNNING;
+		dlpool.queued--;
+		pthread_mutex_unlock(&dlpool.lock);
+
+		download_pkg(dl);
+
+		pthread_mutex_lock(&dlpool.lock);
+		dl->state = DL_DONE;
+		dlpool.done++;
+		pthread_cond_broadcast(&dlpool.cond);
+	}
+	pthread_mutex_unlock(&dlpool.lock);
+
+	return NULL;
+}
+
+/**
+ * \fn download_pkgs
+ *
+ * \brief download packages concurrently, PKGIN_DOWNLOADS at once and
+ * PKGIN_HOST_DOWNLOADS from the same host, with a single progress meter.
+ * Failures are left in each Pkgdl error for the caller to deal with.
+ */
+void
+download_pkgs(Pkgdl *dls, int ndls)
+{
+	pthread_t	workers[MAX_DOWNLOAD_WORKERS];
+	sigset_t	set, oset;
+	struct timeval	now;
+	struct timespec	until;
+	off_t		total = 0;
+	int			i, nworkers;
+	char		label[BUFSIZ], *p;
+
+	if (ndls == 0)
+		return;
+
+	/* summary fetches read libfetch's error, which downloads overwrite */
+	if (fetch_running())
+		errx(EXIT_FAILURE, "downloads started while fetching summaries");
+
+	nworkers = env_limit("PKGIN_DOWNLOADS", DOWNLOAD_WORKERS);
+	if (nworkers > ndls)
+		nworkers = ndls;
+
+	dlpool.dls = dls;
+	dlpool.ndls = dlpool.queued = ndls;
+	dlpool.host_max = env_limit("PKGIN_HOST_DOWNLOADS", HOST_DOWNLOADS);
+	dlpool.done = 0;
+	dlpool.fetched = dlpool.shown = 0;
+
+	for (i = 0; i < ndls; i++) {
+		dls[i].state = DL_QUEUED;
+		dls[i].error = DL_OK;
+		total += dls[i].size;
+	}
+
+	if (ndls > 1)
+		snprintf(label, BUFSIZ, "%d packages", ndls);
+	else if ((p = strrchr(dls[0].url, '/')) != NULL)
+		strlcpy(label, p + 1, BUFSIZ);
+	else
+		strlcpy(label, dls[0].url, BUFSIZ);
+
+	printf(MSG_DOWNLOADING, label);
+	fflush(stdout);
+
+	start_progress_meter(label, total, &dlpool.shown);
+
+	/* the progress meter's SIGALRM is for this thread only */
+	sigemptyset(&set);
+	sigaddset(&set, SIGALRM);
+	pthread_sigmask(SIG_BLOCK, &set, &oset);
+
+	dlpool.threaded = 1;
+	for (i = 0; i < nworkers; i++)
+		if (pthread_create(&workers[i], NULL, download_worker, NULL) != 0)
+			break;
+
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+
+	/* no thread at all, download serially from this one */
+	if ((nworkers = i) == 0) {
+		dlpool.threaded = 0;
+		download_worker(NULL);
+	}
+
+	/*
+	 * the progress meter runs from SIGALRM in this thread and can't take
+	 * the lock: it reads dlpool.shown, copied here meanwhile
+	 */
+	pthread_mutex_lock(&dlpool.lock);
+	while (dlpool.done < ndls) {
+		gettimeofday(&now, NULL);
+		until.tv_sec = now.tv_sec + (now.tv_usec >= 750000);
+		until.tv_nsec = (now.tv_usec + 250000) % 1000000 * 1000;
+		(void)pthread_cond_timedwait(&dlpool.cond, &dlpool.lock, &until);
+		dlpool.shown = dlpool.fetched;
+	}
+	pthread_mutex_unlock(&dlpool.lock);
+
+	for (i = 0; i < nworkers; i++)
+		pthread_join(workers[i], NULL);
+
+	stop_progress_meter();
+}
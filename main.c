@@ -142,8 +142,15 @@ main(int argc, char *argv[])
 	/* check if current database fits our needs */
 	updb_all = upgrade_database();
 
-	/* update local db if pkgdb mtime has changed */
-	(void)update_db(LOCAL_SUMMARY, NULL);
+	/* find command index */
+	ch = find_cmd(argv[0]);
+
+	/*
+	 * update local db if pkgdb mtime has changed, a remote update does
+	 * it while the summaries are being fetched
+	 */
+	if (!updb_all && ch != PKG_UPDT_CMD && ch != PKG_CATALOG_CMD)
+		(void)update_db(LOCAL_SUMMARY, NULL);
 
 	/* split PKG_REPOS env variable and record them */
 	split_repos();
@@ -155,11 +162,9 @@ main(int argc, char *argv[])
 	if (updb_all)
 		(void)update_db(REMOTE_SUMMARY, NULL);
 
-	/* find command index */
-	ch = find_cmd(argv[0]);
-
 	/* we need packages lists for almost everything */
-	if (ch != PKG_UPDT_CMD) /* already loaded by update_db() */
+	/* already loaded by update_db() */
+	if (ch != PKG_UPDT_CMD && ch != PKG_CATALOG_CMD)
 		init_global_pkglists();
 
 	/* fill pkgtools flags */
@@ -258,6 +263,12 @@ main(int argc, char *argv[])
 		missing_param(argc, 2, MSG_MISSING_PKGNAME);
 		show_pkg_info('B', argv[1]); /* pkg_info flag */
 		break;
+	case PKG_CATALOG_CMD: /* prebuilt database for the clients */
+		missing_param(argc, 2, MSG_MISSING_FILENAME);
+		if (update_db(REMOTE_SUMMARY, NULL) == EXIT_FAILURE)
+			errx(EXIT_FAILURE, MSG_DONT_HAVE_RIGHTS);
+		export_catalog(argv[1]);
+		break;
 	case PKG_GINTO_CMD: /* Miod's request */
 		ginto();
 		break;
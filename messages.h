@@ -102,6 +102,7 @@
 
 /* download.c */
 #define MSG_DOWNLOADING "downloading %s:   0%%"
+#define MSG_INVALID_LIMIT "invalid %s: %s"
 #define MSG_DOWNLOADING_PCT "\rdownloading %s: %8s %3d%%"
 
 /* autoremove.c */
@@ -122,11 +123,32 @@ in order to remove packages from the autoremove list, flag those with the `keep'
 #define MSG_CLEANING_DB_FROM_REPO "cleaning database from %s entries...\n"
 #define MSG_PROCESSING_LOCAL_SUMMARY "processing local summary...\n"
 #define MSG_DB_IS_UP_TO_DATE "database for %s is up-to-date\n"
+#define MSG_REMOTE_DELTA "%d packages added, %d changed, %d removed\n"
 #define MSG_PROCESSING_REMOTE_SUMMARY "processing remote summary (%s)...\n"
+#define MSG_PROCESSING_REMOTE_DELTA "processing remote summary delta (%s)...\n"
+#define MSG_DELTA_MISMATCH "%s: delta doesn't match, reading the whole summary\n"
+#define MSG_PROCESSING_REMOTE_CATALOG "processing remote catalog (%s)...\n"
+#define MSG_CATALOG_PKGS "%d packages loaded\n"
+#define MSG_CATALOG_REJECTED "%s: unusable catalog, reading the whole summary\n"
+#define MSG_CATALOG_ONE_REPO "a catalog is built from a single repository, see PKG_REPOS"
+#define MSG_CATALOG_SLIM "%s: slim repository, its catalog would miss fields"
+#define MSG_CATALOG_NO_GEN "%s: packages list incomplete, try update -f"
+#define MSG_CATALOG_WRITTEN "%s: %d packages, generation %s\n"
 #define MSG_COULDNT_FETCH "Could not fetch %s\n"
+#define MSG_REPO_UNREACHABLE "%s is unreachable, keeping its current packages list\n"
+#define MSG_INVALID_TTL "invalid ttl for %s: %s"
+#define MSG_TOO_MANY_REPOS "too many repositories, %d at most"
+#define MSG_INVALID_PROFILE "invalid profile for %s: %s"
+#define MSG_UNSUPPORTED_SUMEXT "unsupported pkg_summary extension: %s"
 #define MSG_ARCH_DONT_MATCH "\r\n/!\\ Warning /!\\ %s doesn't match your current architecture (%s)\nYou probably want to modify "PKGIN_CONF"/"REPOS_FILE".\nStill want to "
 #define MSG_COULD_NOT_GET_PKGNAME "Could not get package name from dependency: %s\n"
 #define MSG_DATABASE_NOT_COMPAT "Database needs to be updated.\n"
+#define MSG_DATABASE_BUSY "%s is in use by another process, waiting...\n"
+#define MSG_DATABASE_BUSY_GIVEUP "%s still in use after %d seconds, giving up"
+#define MSG_STATS_FETCH "fetched %.1f MB in %.2fs\n"
+#define MSG_STATS_DECOMP "decompressed %.1f MB in %.2fs (%.1f MB/s)\n"
+#define MSG_STATS_PARSE "parsed %d records in %.2fs (%.0f records/s)\n"
+#define MSG_STATS_WRITE "%d rows written, commits took %.2fs\n"
 
 /* impact.c */
 #define MSG_GREATER_VERSION \
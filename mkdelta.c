@@ -0,0 +1,292 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2009, 2010 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Emile "iMil" Heitor <imil@NetBSD.org> .
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/**
+ * mkdelta: pkg_summary delta generator, for repository maintainers
+ *
+ *	mkdelta -g pkg_summary
+ *	mkdelta old_pkg_summary new_pkg_summary
+ *
+ * The first form prints the generation of a summary: the sum of the
+ * FNV-1a hashes of its records, which pkgin computes the same way from
+ * its database. The second one writes the delta from old to new to
+ * stdout: the generations and the removed packages, an empty line, then
+ * every added or changed record. Summaries are read uncompressed, the
+ * delta may be compressed as pkg_summary is. A repository publishes:
+ *
+ *	pkg_summary.gen			its current generation
+ *	pkg_summary.delta-<from>-<to>	deltas from previous generations
+ *
+ * for instance, when pkg_summary.bz2 is about to be replaced:
+ *
+ *	bzcat pkg_summary.bz2 > old; bzcat new/pkg_summary.bz2 > new
+ *	from=$(mkdelta -g old); to=$(mkdelta -g new)
+ *	mkdelta old new | bzip2 > pkg_summary.delta-$from-$to
+ *	echo $to > pkg_summary.gen
+ *
+ * Records are hashed as pkgin reads them: without leading blanks, lines
+ * being cut at their first carriage return.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct Rec {
+	char		*name; /*!< PKGNAME, NULL if there's none */
+	size_t		namelen;
+	char		*text; /*!< normalized record, lines end with a newline */
+	size_t		len;
+	uint64_t	hash;
+};
+
+struct Summary {
+	char		*buf; /*!< normalized records, back to back */
+	struct Rec	*recs;
+	size_t		nrecs;
+	size_t		nalloc;
+	uint64_t	gen;
+	size_t		*table; /*!< open addressing, index + 1 in recs */
+	size_t		mask;
+};
+
+/* same as pkgin's str_hash() */
+static uint64_t
+fnv1a(const char *buf, size_t len)
+{
+	uint64_t	h = 0xcbf29ce484222325ULL;
+	size_t		i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)buf[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+static char *
+read_file(const char *path, size_t *len)
+{
+	FILE		*fp;
+	struct stat	st;
+	char		*buf;
+
+	if ((fp = fopen(path, "r")) == NULL || fstat(fileno(fp), &st) < 0)
+		err(EXIT_FAILURE, "%s", path);
+
+	if ((buf = malloc(st.st_size + 1)) == NULL)
+		err(EXIT_FAILURE, "can't allocate memory");
+
+	*len = fread(buf, 1, st.st_size, fp);
+	if (ferror(fp))
+		err(EXIT_FAILURE, "%s", path);
+	fclose(fp);
+
+	return buf;
+}
+
+static void
+add_rec(struct Summary *sum, char *text, size_t len)
+{
+	struct Rec	*r;
+	char		*p;
+
+	if (sum->nrecs == sum->nalloc) {
+		sum->nalloc = sum->nalloc > 0 ? sum->nalloc * 2 : 1024;
+		sum->recs = realloc(sum->recs, sum->nalloc * sizeof(struct Rec));
+		if (sum->recs == NULL)
+			err(EXIT_FAILURE, "can't allocate memory");
+	}
+
+	r = &sum->recs[sum->nrecs++];
+	r->text = text;
+	r->len = len;
+	r->hash = fnv1a(text, len);
+	r->name = NULL;
+
+	for (p = text; p < text + len; p = strchr(p, '\n') + 1)
+		if (strncmp(p, "PKGNAME=", 8) == 0) {
+			r->name = p + 8;
+			r->namelen = strchr(r->name, '\n') - r->name;
+			break;
+		}
+
+	/* pkgin only keeps records with a name */
+	if (r->name != NULL)
+		sum->gen += r->hash;
+}
+
+static struct Rec *
+lookup(struct Summary *sum, const char *name, size_t len)
+{
+	size_t		i;
+	struct Rec	*r;
+
+	for (i = fnv1a(name, len) & sum->mask; sum->table[i] != 0;
+		i = (i + 1) & sum->mask) {
+		r = &sum->recs[sum->table[i] - 1];
+		if (r->namelen == len && memcmp(r->name, name, len) == 0)
+			return r;
+	}
+
+	return NULL;
+}
+
+static void
+index_recs(struct Summary *sum)
+{
+	size_t	i, j, size = 1;
+
+	while (size < sum->nrecs * 2)
+		size *= 2;
+
+	if ((sum->table = calloc(size, sizeof(size_t))) == NULL)
+		err(EXIT_FAILURE, "can't allocate memory");
+	sum->mask = size - 1;
+
+	for (i = 0; i < sum->nrecs; i++) {
+		if (sum->recs[i].name == NULL)
+			continue;
+		for (j = fnv1a(sum->recs[i].name, sum->recs[i].namelen) &
+			sum->mask; sum->table[j] != 0; j = (j + 1) & sum->mask);
+		sum->table[j] = i + 1;
+	}
+}
+
+/* split path to normalized records */
+static void
+load(struct Summary *sum, const char *path)
+{
+	char	*raw, *line, *eol, *end, *out, *rec;
+	size_t	len, n;
+
+	memset(sum, 0, sizeof(struct Summary));
+
+	raw = read_file(path, &len);
+	if ((sum->buf = malloc(len + 1)) == NULL)
+		err(EXIT_FAILURE, "can't allocate memory");
+
+	end = raw + len;
+	out = rec = sum->buf;
+
+	for (line = raw; line < end; line = eol + 1) {
+		if ((eol = memchr(line, '\n', end - line)) == NULL)
+			eol = end;
+
+		while (line < eol && (*line == ' ' || *line == '\t'))
+			line++;
+		n = eol - line;
+		if ((end = memchr(line, '\r', n)) != NULL)
+			n = end - line;
+		end = raw + len;
+
+		/* an empty line closes the record */
+		if (n == 0) {
+			if (out > rec)
+				add_rec(sum, rec, out - rec);
+			rec = out;
+			continue;
+		}
+
+		memcpy(out, line, n);
+		out += n;
+		*out++ = '\n';
+	}
+	if (out > rec)
+		add_rec(sum, rec, out - rec);
+
+	free(raw);
+
+	index_recs(sum);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: mkdelta -g pkg_summary\n"
+		"       mkdelta old_pkg_summary new_pkg_summary\n");
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct Summary	old, new;
+	struct Rec		*r, *o;
+	size_t			i;
+
+	if (argc == 3 && strcmp(argv[1], "-g") == 0) {
+		load(&new, argv[2]);
+		printf("%016llx\n", (unsigned long long)new.gen);
+		return EXIT_SUCCESS;
+	}
+
+	if (argc != 3)
+		usage();
+
+	load(&old, argv[1]);
+	load(&new, argv[2]);
+
+	printf("DELTA_FROM=%016llx\n", (unsigned long long)old.gen);
+	printf("DELTA_TO=%016llx\n", (unsigned long long)new.gen);
+
+	for (i = 0; i < old.nrecs; i++) {
+		r = &old.recs[i];
+		if (r->name != NULL && lookup(&new, r->name, r->namelen) == NULL)
+			printf("REMOVED=%.*s\n", (int)r->namelen, r->name);
+	}
+	printf("\n");
+
+	for (i = 0; i < new.nrecs; i++) {
+		r = &new.recs[i];
+		if (r->name == NULL)
+			continue;
+		o = lookup(&old, r->name, r->namelen);
+		if (o != NULL && o->hash == r->hash)
+			continue;
+		fwrite(r->text, 1, r->len, stdout);
+		printf("\n");
+	}
+
+	if (fflush(stdout) != 0 || ferror(stdout))
+		err(EXIT_FAILURE, "stdout");
+
+	return EXIT_SUCCESS;
+}
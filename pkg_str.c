@@ -215,30 +215,49 @@ non_trivial_glob(char *depend)
 char *
 get_pkgname_from_depend(char *depend)
 {
-	char	*pkgname, *tmp;
+	char	*pkgname;
+
+	if (depend == NULL || *depend == '\0')
+		return NULL;
+
+	XMALLOC(pkgname, strlen(depend) + 1);
+
+	return depend_to_pkgname(depend, pkgname);
+}
+
+/**
+ * \fn depend_to_pkgname
+ *
+ * \brief get_pkgname_from_depend() into buf, which must hold at least
+ * strlen(depend) + 1 bytes
+ */
+char *
+depend_to_pkgname(const char *depend, char *buf)
+{
+	char	*tmp;
 
 	if (depend == NULL || *depend == '\0')
 		return NULL;
 
 	/* 1. worse case, {foo>=1.0,bar-[0-9]*} */
 	if (*depend == '{') {
-		XSTRDUP(pkgname, depend + 1);
-		tmp = strrchr(pkgname, '}');
-		*tmp = '\0'; /* pkgname == "foo,bar" */
+		strcpy(buf, depend + 1);
+		tmp = strrchr(buf, '}');
+		*tmp = '\0'; /* buf == "foo,bar" */
 
 		/* {foo,bar} should always have comma */
-		while ((tmp = strchr(pkgname, ',')) != NULL)
-			*tmp = '\0'; /* pkgname == foo-[0-9]* or whatever */
+		while ((tmp = strchr(buf, ',')) != NULL)
+			*tmp = '\0'; /* buf == foo-[0-9]* or whatever */
 	} else /* we should now have a "normal" pattern */
-		XSTRDUP(pkgname, depend);
+		strcpy(buf, depend);
 
 	/* 2. classic case, foo-[<>{?*\[] */
-	clear_pattern(pkgname);
+	clear_pattern(buf);
 
 	/* 3. only foo-1.0 should remain */
-	cleanup_version(pkgname);
+	cleanup_version(buf);
 
-	return pkgname;
+	return buf;
 }
 
 char **
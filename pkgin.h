@@ -59,6 +59,15 @@
 #define PKG_INFO PKGTOOLS"/pkg_info"
 
 #define PKG_SUMMARY "pkg_summary"
+#define PKG_SUMMARY_GEN PKG_SUMMARY".gen" /* see mkdelta.c */
+#define PKG_CATALOG PKG_SUMMARY".db" /* see export_catalog() */
+#define MAX_FETCH_WORKERS 4 /* repositories fetched concurrently */
+#define PROBE_TIMEOUT 3 /* seconds, see fetch_reachable() */
+#define MAX_PARSE_WORKERS 8 /* summary parser threads */
+#define MAX_BZIP2_WORKERS 8 /* bzip2 block decoder threads */
+#define DOWNLOAD_WORKERS 8 /* packages downloaded concurrently */
+#define HOST_DOWNLOADS 4 /* of which from the same host */
+#define MAX_DOWNLOAD_WORKERS 32
 #define PKGIN_SQL_LOG PKGIN_DB"/sql.log"
 #define PKG_INSTALL_ERR_LOG PKGIN_DB"/pkg_install-err.log"
 #define PKGIN_CACHE PKGIN_DB"/cache"
@@ -113,6 +122,7 @@
 #define PKG_SHPKGCONT_CMD 20
 #define PKG_SHPKGDESC_CMD 21
 #define PKG_SHPKGBDEFS_CMD 22
+#define PKG_CATALOG_CMD 23
 #define PKG_GINTO_CMD 255
 
 #define PKG_EQUAL '='
@@ -131,6 +141,40 @@ typedef struct Dlfile {
 	size_t size;
 } Dlfile;
 
+/**
+ * \struct Pkgdl
+ * \brief a package download, see download_pkgs()
+ */
+typedef struct Pkgdl {
+	char	*url;
+	char	*path; /*!< written to */
+	char	*host; /*!< for per-host limits */
+	off_t	size; /*!< expected size, 0 if unknown */
+	int		state;
+	int		error; /*!< DL_UNAVAIL or DL_FAILED, errmsg says why */
+	char	errmsg[BUFSIZ];
+} Pkgdl;
+
+#define DL_OK		0
+#define DL_UNAVAIL	1 /* not on the repository */
+#define DL_FAILED	2 /* transfer error */
+
+/*!< streamed pkg_summary, see stream.c */
+typedef struct Sumstream Sumstream;
+/*!< parallel bzip2 decoder, see bzpar.c */
+typedef struct Bzpar Bzpar;
+
+/**
+ * \struct Sumstats
+ * \brief summary transfer and decompression statistics
+ */
+typedef struct Sumstats {
+	off_t	fetched; /*!< raw bytes read */
+	off_t	size; /*!< decompressed bytes */
+	double	fetch_time;
+	double	fill_time; /*!< transfer and decompression */
+} Sumstats;
+
 /**
  * \struct Deptree
  * \brief Package dependency tree
@@ -207,10 +251,32 @@ extern Plisthead	l_plisthead;
 extern FILE			*tracefp;
 
 /* download.c*/
+fetchIO		*fetch_url(char *, time_t *, off_t *, int *);
+int			fetch_reachable(const char *);
 Dlfile		*download_file(char *, time_t *);
+void		download_pkgs(Pkgdl *, int);
+/* stream.c */
+Sumstream	*sum_open(char *, time_t *, int *);
+Sumstream	*sum_open_cmd(const char *);
+Sumstream	*sum_spool(Sumstream *);
+char		*sum_getline(Sumstream *);
+size_t		sum_read(Sumstream *, char *, size_t);
+int			sum_progress(Sumstream *);
+void		sum_stats(Sumstream *, Sumstats *);
+void		sum_close(Sumstream *);
+/* bzpar.c */
+Bzpar		*bzpar_open(const char *, size_t, int);
+int			bzpar_read(Bzpar *, char **, size_t *);
+off_t		bzpar_done(Bzpar *);
+void		bzpar_close(Bzpar *);
+/* scan.c */
+void		scan_init(void);
+const char	*scan_line(const char *, const char *, const char **);
 /* summary.c */
 int			update_db(int, char **);
+int			fetch_running(void);
 void		split_repos(void);
+void		export_catalog(const char *);
 /* sqlite_callbacks.c */
 int			pdb_rec_list(void *, int, char **, char **);
 int			pdb_rec_depends(void *, int, char **, char **);
@@ -257,6 +323,7 @@ char	   	*unique_pkg(const char *, const char *);
 Pkglist		*map_pkg_to_dep(Plisthead *, char *);
 uint8_t		non_trivial_glob(char *);
 char		*get_pkgname_from_depend(char *);
+char		*depend_to_pkgname(const char *, char *);
 int			exact_pkgfmt(const char *);
 char		*find_exact_pkg(Plisthead *, const char *);
 int			version_check(char *, char *);
@@ -4,12 +4,19 @@ CREATE TABLE IF NOT EXISTS [PKGDB] (
 
 CREATE TABLE IF NOT EXISTS [REPOS] (
 	"REPO_URL" TEXT UNIQUE,
-	"REPO_MTIME" INTEGER
+	"REPO_MTIME" INTEGER,
+	"REPO_SUMEXT" TEXT,
+	"REPO_TTL" INTEGER,
+	"REPO_CHECKED" INTEGER,
+	"REPO_GEN" TEXT,
+	"REPO_PROFILE" INTEGER DEFAULT 0,
+	"REPO_ID" INTEGER UNIQUE,
+	"REPO_RANK" INTEGER
 );
 
-CREATE TABLE IF NOT EXISTS [REMOTE_PKG] (
+CREATE TABLE IF NOT EXISTS [REPO_PKG] (
     "PKG_ID" INTEGER PRIMARY KEY,
-    "FULLPKGNAME" TEXT UNIQUE,
+    "FULLPKGNAME" TEXT,
     "PKGNAME" TEXT,
     "PKGVERS" TEXT,
     "COMMENT" TEXT ,
@@ -24,7 +31,17 @@ CREATE TABLE IF NOT EXISTS [REMOTE_PKG] (
     "SIZE_PKG" TEXT ,
     "FILE_SIZE" TEXT ,
     "OPSYS" TEXT,
-	"REPOSITORY" TEXT 
+	"REPOSITORY" TEXT ,
+	"PKG_HASH" INTEGER,
+	UNIQUE ("FULLPKGNAME", "REPOSITORY")
+);
+
+CREATE VIEW IF NOT EXISTS [REMOTE_PKG] AS
+SELECT p.* FROM [REPO_PKG] p WHERE NOT EXISTS (
+SELECT 1 FROM [REPO_PKG] q, [REPOS] r, [REPOS] s
+WHERE q.FULLPKGNAME = p.FULLPKGNAME AND q.PKG_ID <> p.PKG_ID AND
+r.REPO_URL = q.REPOSITORY AND s.REPO_URL = p.REPOSITORY AND
+r.REPO_RANK < s.REPO_RANK
 );
 
 CREATE TABLE IF NOT EXISTS [LOCAL_PKG] (
@@ -44,7 +61,11 @@ CREATE TABLE IF NOT EXISTS [LOCAL_PKG] (
     "SIZE_PKG" TEXT ,
     "FILE_SIZE" TEXT ,
     "OPSYS" TEXT,
-	"PKG_KEEP" INTEGER NULL
+	"PKG_KEEP" INTEGER NULL,
+	"PKG_MTIME" INTEGER,
+	"PKG_INODE" INTEGER,
+	"PKG_AUTOMATIC" INTEGER,
+	"PKG_INFO_MTIME" INTEGER
 );
 
 CREATE TABLE IF NOT EXISTS [LOCAL_DEPS] (
@@ -93,27 +114,9 @@ CREATE TABLE IF NOT EXISTS [REMOTE_PROVIDES] (
 [REMOTE_PROVIDES_PKGNAME] TEXT  
 );
 
-CREATE INDEX IF NOT EXISTS [idx_remote_pkg_category] ON [REMOTE_PKG](
-[CATEGORIES]  ASC
-);
-CREATE INDEX IF NOT EXISTS [idx_remote_pkg_comment] ON [REMOTE_PKG](
-[COMMENT]  ASC
-);
-CREATE INDEX IF NOT EXISTS [idx_remote_pkg_description] ON [REMOTE_PKG](
-[DESCRIPTION]  ASC
-);
-CREATE INDEX IF NOT EXISTS [idx_remote_pkg_name] ON [REMOTE_PKG](
+CREATE INDEX IF NOT EXISTS [idx_remote_pkg_name] ON [REPO_PKG](
 [PKGNAME]  ASC
 );
-CREATE INDEX IF NOT EXISTS [idx_local_pkg_category] ON [LOCAL_PKG](
-[CATEGORIES]  ASC
-);
-CREATE INDEX IF NOT EXISTS [idx_local_pkg_comment] ON [LOCAL_PKG](
-[COMMENT]  ASC
-);
-CREATE INDEX IF NOT EXISTS [idx_local_pkg_description] ON [LOCAL_PKG](
-[DESCRIPTION]  ASC
-);
 CREATE INDEX IF NOT EXISTS [idx_local_pkg_name] ON [LOCAL_PKG](
 [PKGNAME]  ASC
 );
@@ -31,12 +31,18 @@
  */
 
 #include <sqlite3.h>
+#include <fcntl.h>
 #include "pkgin.h"
 
 static sqlite3	*pdb;
 static char		*pdberr = NULL;
 static int		pdbres = 0;
 static FILE		*sql_log_fp;
+static int		lock_fd = -1; /*!< PDB_LOCK, see pkgindb_lock() */
+static int		lock_depth = 0;
+static uint8_t	shadowed = 0; /*!< writing to PDB_SHADOW */
+static dev_t	pdb_dev; /*!< PDB as opened, an update may replace it */
+static ino_t	pdb_ino;
 
 static const char *pragmaopts[] = {
 	"cache_size = 1000000",
@@ -127,6 +133,78 @@ pkgindb_doquery(const char *query,
 	return PDB_OK;
 }
 
+/**
+ * \fn pkgindb_prepare
+ *
+ * \brief compile a query to be run many times with pkgindb_step()
+ */
+sqlite3_stmt *
+pkgindb_prepare(const char *fmt, ...)
+{
+	sqlite3_stmt	*stmt;
+	va_list			ap;
+	char			query[BUFSIZ];
+
+	va_start(ap, fmt);
+	vsnprintf(query, BUFSIZ, fmt, ap);
+	va_end(ap);
+
+	if (sqlite3_prepare_v2(pdb, query, -1, &stmt, NULL) != SQLITE_OK) {
+		if (sql_log_fp != NULL) {
+			fprintf(sql_log_fp, "SQL error: %s\n", sqlite3_errmsg(pdb));
+			fprintf(sql_log_fp, "SQL query: %s\n", query);
+		}
+
+		return NULL;
+	}
+
+	return stmt;
+}
+
+/**
+ * \fn pkgindb_step
+ *
+ * \brief run a prepared statement with its bound values, then reset
+ * it and clear bindings for the next row
+ */
+int
+pkgindb_step(sqlite3_stmt *stmt)
+{
+	int	rc = PDB_OK;
+
+	if (stmt == NULL)
+		return PDB_ERR;
+
+	if (sqlite3_step(stmt) != SQLITE_DONE) {
+		if (sql_log_fp != NULL) {
+			fprintf(sql_log_fp, "SQL error: %s\n", sqlite3_errmsg(pdb));
+			fprintf(sql_log_fp, "SQL query: %s\n", sqlite3_sql(stmt));
+		}
+		rc = PDB_ERR;
+	}
+
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+
+	return rc;
+}
+
+void
+pkgindb_finalize(sqlite3_stmt **stmt)
+{
+	if (*stmt != NULL) {
+		sqlite3_finalize(*stmt);
+		*stmt = NULL;
+	}
+}
+
+/* rows inserted, updated or deleted since the database was opened */
+int
+pkgindb_changes(void)
+{
+	return sqlite3_total_changes(pdb);
+}
+
 void
 pkgindb_close()
 {
@@ -154,20 +232,59 @@ upgrade_database()
 	return 0;
 }
 
-void
-pkgindb_init()
+/**
+ * \fn pdb_rank
+ *
+ * \brief SQL function ranking a REMOTE_SEARCH row from its
+ * matchinfo(REMOTE_SEARCH, 'pcx'): each phrase hit counts for its column
+ * weight, divided by the phrase hits over the whole index
+ */
+static void
+pdb_rank(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	/* PKGNAME, COMMENT, DESCRIPTION */
+	static const double	weight[] = { 8.0, 2.0, 1.0 };
+	const unsigned int	*mi, *hits;
+	unsigned int		nphrase, ncol, p, c;
+	double				rank = 0.0;
+
+	mi = sqlite3_value_blob(argv[0]);
+	if (mi == NULL ||
+		sqlite3_value_bytes(argv[0]) < 2 * (int)sizeof(unsigned int)) {
+		sqlite3_result_error(ctx, "pdb_rank: bad matchinfo", -1);
+		return;
+	}
+
+	nphrase = mi[0];
+	ncol = mi[1];
+	if ((size_t)sqlite3_value_bytes(argv[0]) <
+		(2 + 3 * nphrase * ncol) * sizeof(unsigned int)) {
+		sqlite3_result_error(ctx, "pdb_rank: bad matchinfo", -1);
+		return;
+	}
+
+	for (p = 0; p < nphrase; p++)
+		for (c = 0; c < ncol && c < 3; c++) {
+			hits = &mi[2 + 3 * (p * ncol + c)];
+			if (hits[0] > 0)
+				rank += weight[c] * hits[0] / hits[1];
+		}
+
+	sqlite3_result_double(ctx, rank);
+}
+
+/* open path as pdb, with pkgin's settings */
+static void
+pdb_open(const char *path)
 {
 	int i;
 	char buf[BUFSIZ];
+	struct stat st;
 
-	/*
-	 * Do not exit if PKGIN_SQL_LOG is not writable.
-	 * Permit users to do list-operations
-	 */
-	sql_log_fp = fopen(PKGIN_SQL_LOG, "w");
-
-	if (sqlite3_open(PDB, &pdb) != SQLITE_OK)
-		pdb_err("Can't open database " PDB);
+	if (sqlite3_open(path, &pdb) != SQLITE_OK) {
+		snprintf(buf, BUFSIZ, "Can't open database %s", path);
+		pdb_err(buf);
+	}
 
 	/* generic query in order to check tables existence */
 	if (pkgindb_doquery("select * from sqlite_master;",
@@ -180,7 +297,271 @@ pkgindb_init()
 		pkgindb_doquery(buf, NULL, NULL);
 	}
 
+	sqlite3_create_function(pdb, "pdb_rank", 1, SQLITE_UTF8, NULL,
+		pdb_rank, NULL, NULL);
+
+	if (stat(path, &st) == 0) {
+		pdb_dev = st.st_dev;
+		pdb_ino = st.st_ino;
+	}
+}
+
+void
+pkgindb_init()
+{
+	/*
+	 * Do not exit if PKGIN_SQL_LOG is not writable.
+	 * Permit users to do list-operations
+	 */
+	sql_log_fp = fopen(PKGIN_SQL_LOG, "w");
+
+	pdb_open(PDB);
+
 	pkgindb_doquery(CREATE_DRYDB, NULL, NULL);
+
+	/*
+	 * full-text search index, when SQLite has FTS4. Packages imported
+	 * before it existed are not indexed, have them reloaded.
+	 */
+	if (pkgindb_doquery("SELECT name FROM sqlite_master "
+			"WHERE name = 'REMOTE_SEARCH';",
+			pkgindb_simple_callback, NULL) != PDB_OK &&
+		pkgindb_doquery(CREATE_REMOTE_SEARCH, NULL, NULL) == PDB_OK)
+		pkgindb_doquery(REINDEX_REMOTE, NULL, NULL);
+}
+
+/**
+ * \fn pkgindb_lock
+ *
+ * \brief serialize database writers, from their first read of what they
+ * are about to change to their last write: an update replaces the whole
+ * database when done, see pkgindb_swap(). Calls nest, each one being
+ * paired with pkgindb_unlock().
+ */
+void
+pkgindb_lock(void)
+{
+	struct flock	fl;
+	struct stat		st;
+
+	if (lock_depth++ > 0)
+		return;
+
+	if ((lock_fd = open(PDB_LOCK, O_RDWR | O_CREAT, 0644)) < 0)
+		err(EXIT_FAILURE, MSG_CANT_OPEN_WRITE, PDB_LOCK);
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	if (fcntl(lock_fd, F_SETLKW, &fl) < 0)
+		err(EXIT_FAILURE, "can't lock %s", PDB_LOCK);
+
+	/* an update may have been swapped in since pdb was opened */
+	if (stat(PDB, &st) == 0 &&
+		(st.st_dev != pdb_dev || st.st_ino != pdb_ino)) {
+		sqlite3_close(pdb);
+		pdb_open(PDB);
+	}
+}
+
+void
+pkgindb_unlock(void)
+{
+	if (lock_depth == 0 || --lock_depth > 0)
+		return;
+
+	close(lock_fd);
+	lock_fd = -1;
+}
+
+/**
+ * \fn pkgindb_shadow
+ *
+ * \brief have the following writes go to a copy of the database, which
+ * pkgindb_swap() then renames in place. Meanwhile other pkgin instances
+ * keep reading the current database, which an interrupted update leaves
+ * untouched. The caller holds pkgindb_lock() until the swap, so no other
+ * writer's changes are lost by it.
+ */
+void
+pkgindb_shadow(void)
+{
+	sqlite3			*shadow;
+	sqlite3_backup	*bk;
+	int				rc, waited = 0;
+
+	if (lock_depth == 0)
+		errx(EXIT_FAILURE, "%s is not locked", PDB);
+
+	/* left by an interrupted update */
+	(void)unlink(PDB_SHADOW);
+
+	if (sqlite3_open(PDB_SHADOW, &shadow) != SQLITE_OK)
+		pdb_err("Can't open database " PDB_SHADOW);
+
+	if ((bk = sqlite3_backup_init(shadow, "main", pdb, "main")) == NULL) {
+		warnx("Can't copy database: %s", sqlite3_errmsg(shadow));
+		sqlite3_close(shadow);
+		pdb_err("Can't copy database");
+	}
+
+	/*
+	 * another process holds the database, an older pkgin or one in
+	 * locking_mode EXCLUSIVE, wait for it a while
+	 */
+	while ((rc = sqlite3_backup_step(bk, -1)) == SQLITE_BUSY ||
+		rc == SQLITE_LOCKED) {
+		if (waited == 0)
+			fprintf(stderr, MSG_DATABASE_BUSY, PDB);
+		if (waited >= PDB_BUSY_WAIT * 10)
+			break;
+		sqlite3_sleep(100);
+		waited++;
+	}
+
+	sqlite3_backup_finish(bk);
+	sqlite3_close(shadow);
+
+	if (rc == SQLITE_BUSY || rc == SQLITE_LOCKED) {
+		(void)unlink(PDB_SHADOW);
+		errx(EXIT_FAILURE, MSG_DATABASE_BUSY_GIVEUP, PDB, PDB_BUSY_WAIT);
+	}
+	if (rc != SQLITE_DONE)
+		pdb_err("Can't copy database");
+
+	sqlite3_close(pdb);
+	pdb_open(PDB_SHADOW);
+	shadowed = 1;
+}
+
+/**
+ * \fn pkgindb_swap
+ *
+ * \brief replace the database by the shadow written since
+ * pkgindb_shadow(). Instances which opened the former one keep reading
+ * it until they exit.
+ */
+void
+pkgindb_swap(void)
+{
+	int	fd;
+
+	if (!shadowed)
+		return;
+
+	sqlite3_close(pdb);
+
+	/* synchronous is OFF, have the data on disk before it's visible */
+	if ((fd = open(PDB_SHADOW, O_RDONLY)) >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+
+	if (rename(PDB_SHADOW, PDB) < 0)
+		err(EXIT_FAILURE, "can't rename %s to %s", PDB_SHADOW, PDB);
+
+	pdb_open(PDB);
+	shadowed = 0;
+}
+
+/* drop what's not a table from a catalog being created */
+static int
+catalog_tables_only(sqlite3 *db)
+{
+	sqlite3_stmt	*stmt;
+	char			*drops = NULL, drop[BUFSIZ];
+	size_t			len = 0;
+	int				n, rc;
+
+	if (sqlite3_prepare_v2(db, CATALOG_NON_TABLES, -1, &stmt, NULL)
+		!= SQLITE_OK)
+		return sqlite3_errcode(db);
+
+	/* sqlite_master can't be changed while it's being read */
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		n = snprintf(drop, BUFSIZ, "DROP %s [%s];",
+			sqlite3_column_text(stmt, 0), sqlite3_column_text(stmt, 1));
+		XREALLOC(drops, len + n + 1);
+		memcpy(drops + len, drop, n + 1);
+		len += n;
+	}
+
+	if ((rc = sqlite3_finalize(stmt)) == SQLITE_OK && drops != NULL)
+		rc = sqlite3_exec(db, drops, NULL, NULL, NULL);
+
+	XFREE(drops);
+
+	return rc;
+}
+
+/**
+ * \fn pkgindb_attach
+ *
+ * \brief attach the database file path as "catalog". With create, path
+ * is replaced by an empty database with pkgin's tables only, else it has
+ * to pass SQLite's quick check and hold nothing but such tables: a
+ * download may be anything, and its schema is not trusted.
+ */
+int
+pkgindb_attach(const char *path, uint8_t create)
+{
+	sqlite3	*db;
+	char	query[BUFSIZ], buf[BUFSIZ];
+	int		rc;
+
+	if (create) {
+		(void)unlink(path);
+
+		if ((rc = sqlite3_open(path, &db)) == SQLITE_OK)
+			rc = sqlite3_exec(db, CREATE_DRYDB, NULL, NULL, NULL);
+		if (rc == SQLITE_OK)
+			rc = sqlite3_exec(db, CREATE_CATALOG, NULL, NULL, NULL);
+		if (rc == SQLITE_OK)
+			rc = catalog_tables_only(db);
+		if (rc != SQLITE_OK)
+			warnx("Can't create database %s: %s", path,
+				sqlite3_errmsg(db));
+		sqlite3_close(db);
+
+		if (rc != SQLITE_OK)
+			return PDB_ERR;
+	}
+
+	/*
+	 * no function of the downloaded schema's views and triggers is run,
+	 * for SQLite versions which know that pragma
+	 */
+	if (!create)
+		pkgindb_doquery("PRAGMA trusted_schema = OFF;", NULL, NULL);
+
+	snprintf(query, BUFSIZ, "ATTACH DATABASE '%s' AS catalog;", path);
+	if (pkgindb_doquery(query, NULL, NULL) != PDB_OK)
+		return PDB_ERR;
+
+	if (create)
+		return PDB_OK;
+
+	buf[0] = '\0';
+	if (pkgindb_doquery("PRAGMA catalog.quick_check;",
+			pdb_get_value, buf) != PDB_OK || strcmp(buf, "ok") != 0) {
+		pkgindb_detach();
+		return PDB_ERR;
+	}
+
+	buf[0] = '\0';
+	if (pkgindb_doquery(CATALOG_UNEXPECTED, pdb_get_value, buf) != PDB_OK ||
+		strcmp(buf, "0") != 0) {
+		pkgindb_detach();
+		return PDB_ERR;
+	}
+
+	return PDB_OK;
+}
+
+void
+pkgindb_detach(void)
+{
+	pkgindb_doquery("DETACH DATABASE catalog;", NULL, NULL);
 }
 
 /**
@@ -244,10 +625,35 @@ repo_record(char **repos)
 			/* repository does not exists */
 			snprintf(query, BUFSIZ, INSERT_REPO, repos[i]);
 			pkgindb_doquery(query, NULL, NULL);
+
+			snprintf(query, BUFSIZ, REPO_ID, repos[i]);
+			value[0] = '\0';
+			pkgindb_doquery(query, pdb_get_value, &value[0]);
+			if (strtol(value, (char **)NULL, 10) > MAX_REPO_ID)
+				errx(EXIT_FAILURE, MSG_TOO_MANY_REPOS, MAX_REPO_ID);
 		}
 	}
 }
 
+/**
+ * \fn repo_pkg_ids
+ *
+ * \brief first and last PKG_ID of repo's REPO_PKG partition, the first
+ * one is never used
+ */
+void
+repo_pkg_ids(const char *repo, int *first, int *last)
+{
+	char	query[BUFSIZ], value[20];
+
+	snprintf(query, BUFSIZ, REPO_ID, repo);
+	value[0] = '\0';
+	pkgindb_doquery(query, pdb_get_value, &value[0]);
+
+	*first = (int)strtol(value, (char **)NULL, 10) << REPO_ID_SHIFT;
+	*last = *first + ((1 << REPO_ID_SHIFT) - 1);
+}
+
 time_t
 pkg_sum_mtime(char *repo)
 {
@@ -265,3 +671,17 @@ pkg_sum_mtime(char *repo)
 
 	return db_mtime;
 }
+
+/* extension of repo's last fetched summary, empty if unknown */
+void
+pkg_sum_ext(char *repo, char *sumext)
+{
+	char	query[BUFSIZ];
+
+	sumext[0] = '\0';
+
+	snprintf(query, BUFSIZ,
+		"SELECT IFNULL(REPO_SUMEXT, '') FROM REPOS "
+		"WHERE REPO_URL GLOB \'%s*\';", repo);
+	pkgindb_doquery(query, pdb_get_value, sumext);
+}
@@ -33,7 +33,9 @@
 #ifndef _DRYDB_H
 #define _DRYDB_H
 
+#include <limits.h>
 #include <stdint.h>
+#include <sqlite3.h>
 #include "pkgindb_create.h"
 
 extern const char DROP_LOCAL_TABLES[];
@@ -63,7 +65,17 @@ extern const char DELETE_EMPTY_ROWS[];
 extern const char UPDATE_PKGDB_MTIME[];
 extern const char EXISTS_REPO[];
 extern const char INSERT_REPO[];
+extern const char REPO_ID[];
+extern const char UPDATE_REPO_RANK[];
 extern const char UPDATE_REPO_MTIME[];
+extern const char UPDATE_REPO_TTL[];
+extern const char UPDATE_REPO_CHECKED[];
+extern const char UPDATE_REPO_GEN[];
+extern const char REPO_GEN[];
+extern const char UPDATE_REPO_PROFILE[];
+extern const char REPO_PROFILE[];
+extern const char REPO_PKG_HASHES[];
+extern const char REPO_FRESH[];
 extern const char INSERT_SINGLE_VALUE[];
 extern const char INSERT_DEPENDS_VALUES[];
 extern const char UNIQUE_EXACT_PKG[];
@@ -72,11 +84,56 @@ extern const char EXPORT_KEEP_LIST[];
 extern const char GET_PKGNAME_BY_PKGPATH[];
 extern const char GET_ORPHAN_PACKAGES[];
 extern const char COMPAT_CHECK[];
+extern const char NEXT_PKG_ID[];
+extern const char NEXT_REPO_PKG_ID[];
+extern const char REMOTE_PKG_HASH[];
+extern const char DELETE_PKG_ID[];
+extern const char CREATE_REMOTE_SEEN[];
+extern const char INSERT_REMOTE_SEEN[];
+extern const char COUNT_UNSEEN_REMOTE[];
+extern const char DELETE_UNSEEN_REMOTE[];
+extern const char LOCAL_PKG_SNAPSHOT[];
+extern const char COUNT_KEEP_LOCAL[];
+extern const char CREATE_LOCAL_KEPT[];
+extern const char INSERT_LOCAL_KEPT[];
+extern const char RESTORE_LOCAL_KEPT[];
+extern const char KEEP_NEW_MANUAL_LOCAL[];
+extern const char NEW_MANUAL_LOCAL_PKGS[];
+extern const char UPDATE_LOCAL_AUTOMATIC[];
+extern const char CREATE_REMOTE_SEARCH[];
+extern const char REINDEX_REMOTE[];
+extern const char INSERT_REMOTE_SEARCH[];
+extern const char DELETE_SEARCH_ID[];
+extern const char DELETE_REMOTE_SEARCH[];
+extern const char DELETE_UNSEEN_SEARCH[];
+extern const char SEARCH_REMOTE_PKGS[];
+extern const char CREATE_CATALOG[];
+extern const char CATALOG_NON_TABLES[];
+extern const char CATALOG_UNEXPECTED[];
+extern const char CATALOG_INFO[];
+extern const char INSERT_CATALOG_INFO[];
+extern const char EXPORT_CATALOG_TBL[];
+extern const char IMPORT_CATALOG_TBL[];
+extern const char CATALOG_PKG_HASHES[];
+extern const char EXPORT_CATALOG_SEARCH[];
+extern const char IMPORT_CATALOG_SEARCH[];
+extern const char IMPORT_CATALOG_SEARCH_SLIM[];
 
 #define LOCAL_PKG "LOCAL_PKG"
 #define REMOTE_PKG "REMOTE_PKG"
 
 #define PDB PKGIN_DB"/pkgin.db"
+#define PDB_SHADOW PDB".new" /* remote update, see pkgindb_shadow() */
+#define PDB_LOCK PDB".lock"
+#define PDB_BUSY_WAIT 60 /* seconds, see pkgindb_shadow() */
+#define PDB_CATALOG PDB".catalog" /* downloaded catalog, see import_catalog() */
+
+/* bumped when a catalog's content changes meaning, see export_catalog() */
+#define CATALOG_VERSION 2
+
+/* REPO_PKG partitions: PKG_ID = REPO_ID << REPO_ID_SHIFT | n */
+#define REPO_ID_SHIFT 24
+#define MAX_REPO_ID (INT_MAX >> REPO_ID_SHIFT)
 
 uint8_t		have_enough_rights(void);
 const char	*pdb_version(void);
@@ -85,11 +142,23 @@ void		pkgindb_init(void);
 void		pkgindb_close(void);
 int			pkgindb_doquery(const char *,
 	int (*pkgindb_callback)(void *, int, char **, char **), void *);
+sqlite3_stmt	*pkgindb_prepare(const char *, ...);
+int			pkgindb_step(sqlite3_stmt *);
+void		pkgindb_finalize(sqlite3_stmt **);
+int			pkgindb_changes(void);
 int			pdb_get_value(void *, int, char **, char **);
 int			pkg_db_mtime(void);
 void		repo_record(char **);
+void		repo_pkg_ids(const char *, int *, int *);
 time_t		pkg_sum_mtime(char *);
+void		pkg_sum_ext(char *, char *);
 void		pkgindb_reset(void);
+void		pkgindb_lock(void);
+void		pkgindb_unlock(void);
+void		pkgindb_shadow(void);
+void		pkgindb_swap(void);
+int			pkgindb_attach(const char *, uint8_t);
+void		pkgindb_detach(void);
 
 #define PDB_OK 0
 #define PDB_ERR -1
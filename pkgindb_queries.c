@@ -39,7 +39,8 @@ const char const DROP_LOCAL_TABLES[] =
 
 const char DROP_REMOTE_TABLES[] =
     "DROP TABLE IF EXISTS REMOTE_DEPS;"
-    "DROP TABLE IF EXISTS REMOTE_PKG;"
+    "DROP VIEW IF EXISTS REMOTE_PKG;"
+    "DROP TABLE IF EXISTS REPO_PKG;"
     "DROP TABLE IF EXISTS REMOTE_CONFLICTS;"
     "DROP TABLE IF EXISTS REMOTE_REQUIRES;"
     "DROP TABLE IF EXISTS REMOTE_PROVIDES;";
@@ -51,11 +52,9 @@ const char DELETE_LOCAL[] =
     "DELETE FROM LOCAL_REQUIRES;"
     "DELETE FROM LOCAL_PROVIDES;";
 
+/* a repository's partition, see repo_pkg_ids() */
 const char DELETE_REMOTE[] =
-	"DELETE FROM %s WHERE %s_ID IN "
-	"(SELECT %s.%s_ID FROM REMOTE_PKG, %s "
-	"WHERE REMOTE_PKG.REPOSITORY GLOB '%s*' AND "
-	"REMOTE_PKG.PKG_ID = %s.PKG_ID);";
+	"DELETE FROM %s WHERE PKG_ID BETWEEN %d AND %d;";
 
 const char DIRECT_DEPS[] = /* prefer higher version */
 	"SELECT REMOTE_DEPS_DEWEY, REMOTE_DEPS_PKGNAME "
@@ -150,7 +149,7 @@ const char PKG_URL[] =
     "SELECT REPOSITORY FROM REMOTE_PKG WHERE FULLPKGNAME = \'%s\';";
 
 const char DELETE_EMPTY_ROWS[] =
-    "DELETE FROM REMOTE_PKG WHERE PKGNAME IS NULL;";
+    "DELETE FROM REPO_PKG WHERE PKGNAME IS NULL;";
 
 const char UPDATE_PKGDB_MTIME[] =
     "REPLACE INTO PKGDB (PKGDB_MTIME) VALUES (%lld);";
@@ -158,17 +157,56 @@ const char UPDATE_PKGDB_MTIME[] =
 const char EXISTS_REPO[] =
     "SELECT COUNT(*) FROM REPOS WHERE REPO_URL = \'%s\';";
 
+/* with the lowest free REPO_ID */
 const char INSERT_REPO[] =
-    "INSERT INTO REPOS (REPO_URL, REPO_MTIME) VALUES (\'%s\', 0);";
+    "INSERT INTO REPOS (REPO_URL, REPO_MTIME, REPO_ID) VALUES (\'%s\', 0, "
+    "(SELECT MIN(ID) + 1 FROM (SELECT 0 AS ID UNION ALL "
+    "SELECT REPO_ID FROM REPOS) WHERE ID + 1 NOT IN "
+    "(SELECT REPO_ID FROM REPOS WHERE REPO_ID IS NOT NULL)));";
+
+const char REPO_ID[] =
+    "SELECT REPO_ID FROM REPOS WHERE REPO_URL = \'%s\';";
+
+/* REMOTE_PKG shows the first repository's package, see pkgin.sql */
+const char UPDATE_REPO_RANK[] =
+    "UPDATE REPOS SET REPO_RANK = %d WHERE REPO_URL = \'%s\';";
 
 const char UPDATE_REPO_MTIME[] =
-    "UPDATE REPOS SET REPO_MTIME = %lld WHERE REPO_URL = \'%s\';";
+    "UPDATE REPOS SET REPO_MTIME = %lld, REPO_SUMEXT = \'%s\' "
+    "WHERE REPO_URL = \'%s\';";
+
+const char UPDATE_REPO_TTL[] =
+    "UPDATE REPOS SET REPO_TTL = %d WHERE REPO_URL = \'%s\';";
+
+const char UPDATE_REPO_CHECKED[] =
+    "UPDATE REPOS SET REPO_CHECKED = %lld WHERE REPO_URL = \'%s\';";
+
+const char UPDATE_REPO_GEN[] =
+    "UPDATE REPOS SET REPO_GEN = \'%s\' WHERE REPO_URL = \'%s\';";
+
+const char REPO_GEN[] =
+    "SELECT IFNULL(REPO_GEN, '') FROM REPOS WHERE REPO_URL = \'%s\';";
+
+const char UPDATE_REPO_PROFILE[] =
+    "UPDATE REPOS SET REPO_PROFILE = %d WHERE REPO_URL = \'%s\';";
+
+const char REPO_PROFILE[] =
+    "SELECT IFNULL(REPO_PROFILE, 0) FROM REPOS WHERE REPO_URL = \'%s\';";
+
+/* summed by repo_gen() */
+const char REPO_PKG_HASHES[] =
+	"SELECT PKG_HASH FROM REPO_PKG WHERE PKG_ID BETWEEN ? AND ?;";
 
+const char REPO_FRESH[] =
+    "SELECT COUNT(*) FROM REPOS WHERE REPO_URL = \'%s\' AND "
+    "REPO_TTL > 0 AND REPO_CHECKED + REPO_TTL > %lld;";
+
+/* prepared statements, values are bound by summary.c */
 const char INSERT_SINGLE_VALUE[] =
-	"INSERT INTO %s (PKG_ID, %s_PKGNAME) VALUES (%d,\"%s\");";
+	"INSERT INTO %s (PKG_ID, %s_PKGNAME) VALUES (?,?);";
 
 const char INSERT_DEPENDS_VALUES[] = 
-	"INSERT INTO %s (PKG_ID, %s_PKGNAME, %s_DEWEY) VALUES (%d,\"%s\",\"%s\");";
+	"INSERT INTO %s (PKG_ID, %s_PKGNAME, %s_DEWEY) VALUES (?,?,?);";
 
 const char UNIQUE_PKG[] = 
 	"SELECT FULLPKGNAME FROM %s WHERE PKGNAME = '%s' "
@@ -189,5 +227,183 @@ const char GET_ORPHAN_PACKAGES[] =
 	"SELECT FULLPKGNAME FROM LOCAL_PKG WHERE PKG_KEEP IS NULL AND "
 	"PKGNAME NOT IN (SELECT LOCAL_DEPS_PKGNAME FROM LOCAL_DEPS);";
 
+/*
+ * PKG_HASH appeared with per-package updates, REPO_SUMEXT with
+ * conditional fetch, REPO_CHECKED with freshness TTLs, REPO_GEN with
+ * delta summaries, REPO_PROFILE with slim repositories, REPO_ID with
+ * per-repository partitions and PKG_INODE with incremental local
+ * refresh. COUNT() as these tables may legitimately be empty.
+ */
 const char COMPAT_CHECK[] =
-	"SELECT FULLPKGNAME FROM REMOTE_PKG LIMIT 1;";
+	"SELECT FULLPKGNAME,PKG_HASH FROM REPO_PKG LIMIT 1;"
+	"SELECT COUNT(REPO_SUMEXT), COUNT(REPO_CHECKED), COUNT(REPO_GEN), "
+	"COUNT(REPO_PROFILE), COUNT(REPO_ID), COUNT(REPO_RANK) FROM REPOS;"
+	"SELECT COUNT(PKG_INODE), COUNT(PKG_AUTOMATIC) FROM LOCAL_PKG;";
+
+const char NEXT_PKG_ID[] =
+	"SELECT IFNULL(MAX(PKG_ID), 0) + 1 FROM %s;";
+
+const char NEXT_REPO_PKG_ID[] =
+	"SELECT IFNULL(MAX(PKG_ID), %d) + 1 FROM REPO_PKG "
+	"WHERE PKG_ID BETWEEN %d AND %d;";
+
+/* per-package updates, see insert_summary() */
+const char REMOTE_PKG_HASH[] =
+	"SELECT PKG_ID, PKG_HASH FROM REPO_PKG "
+	"WHERE FULLPKGNAME = ? AND REPOSITORY = ?;";
+
+const char DELETE_PKG_ID[] =
+	"DELETE FROM %s WHERE PKG_ID = ?;";
+
+const char CREATE_REMOTE_SEEN[] =
+	"CREATE TEMP TABLE IF NOT EXISTS REMOTE_SEEN "
+	"(PKG_ID INTEGER PRIMARY KEY);";
+
+const char INSERT_REMOTE_SEEN[] =
+	"INSERT OR IGNORE INTO REMOTE_SEEN (PKG_ID) VALUES (?);";
+
+const char COUNT_UNSEEN_REMOTE[] =
+	"SELECT COUNT(*) FROM REPO_PKG WHERE PKG_ID BETWEEN %d AND %d "
+	"AND PKG_ID NOT IN (SELECT PKG_ID FROM REMOTE_SEEN);";
+
+const char DELETE_UNSEEN_REMOTE[] =
+	"DELETE FROM %s WHERE PKG_ID BETWEEN %d AND %d "
+	"AND PKG_ID NOT IN (SELECT PKG_ID FROM REMOTE_SEEN);";
+
+/* incremental local refresh, see update_localdb() */
+const char LOCAL_PKG_SNAPSHOT[] =
+	"SELECT PKG_ID, FULLPKGNAME, PKG_MTIME, PKG_INODE, PKG_INFO_MTIME "
+	"FROM LOCAL_PKG ORDER BY FULLPKGNAME;";
+
+const char COUNT_KEEP_LOCAL[] =
+	"SELECT COUNT(*) FROM LOCAL_PKG WHERE PKG_KEEP IS NOT NULL;";
+
+const char CREATE_LOCAL_KEPT[] =
+	"CREATE TEMP TABLE IF NOT EXISTS LOCAL_KEPT "
+	"(PKGNAME TEXT PRIMARY KEY);"
+	"DELETE FROM LOCAL_KEPT;";
+
+const char INSERT_LOCAL_KEPT[] =
+	"INSERT OR IGNORE INTO LOCAL_KEPT (PKGNAME) "
+	"SELECT PKGNAME FROM LOCAL_PKG "
+	"WHERE PKG_ID = ? AND PKG_KEEP IS NOT NULL;";
+
+/* a replaced package inherits the keep flag of the one it replaces */
+const char RESTORE_LOCAL_KEPT[] =
+	"UPDATE LOCAL_PKG SET PKG_KEEP = 1 WHERE PKG_ID >= %d "
+	"AND PKGNAME IN (SELECT PKGNAME FROM LOCAL_KEPT);";
+
+/* PKG_AUTOMATIC caches pkgdb's automatic flag, see update_localdb() */
+const char KEEP_NEW_MANUAL_LOCAL[] =
+	"UPDATE LOCAL_PKG SET PKG_KEEP = 1 WHERE PKG_ID >= %d "
+	"AND IFNULL(PKG_AUTOMATIC, 0) = 0;";
+
+const char NEW_MANUAL_LOCAL_PKGS[] =
+	"SELECT FULLPKGNAME,PKGNAME FROM LOCAL_PKG "
+	"WHERE PKG_KEEP IS NULL AND PKG_ID >= %d "
+	"AND IFNULL(PKG_AUTOMATIC, 0) = 0;";
+
+const char UPDATE_LOCAL_AUTOMATIC[] =
+	"UPDATE LOCAL_PKG SET PKG_AUTOMATIC = 1, PKG_INFO_MTIME = ? "
+	"WHERE FULLPKGNAME = ?;";
+
+/*
+ * full-text index of remote packages, docid is REPO_PKG's PKG_ID.
+ * Not part of pkgin.sql as the SQLite library may lack FTS4.
+ */
+const char CREATE_REMOTE_SEARCH[] =
+	"CREATE VIRTUAL TABLE REMOTE_SEARCH "
+	"USING fts4(PKGNAME, COMMENT, DESCRIPTION);";
+
+/* an index created over an existing database: reload every package */
+const char REINDEX_REMOTE[] =
+	"UPDATE REPO_PKG SET PKG_HASH = NULL;"
+	"UPDATE REPOS SET REPO_MTIME = 0, REPO_CHECKED = NULL, "
+	"REPO_GEN = NULL;";
+
+const char INSERT_REMOTE_SEARCH[] =
+	"INSERT INTO REMOTE_SEARCH (docid, PKGNAME, COMMENT, DESCRIPTION) "
+	"VALUES (?,?,?,?);";
+
+const char DELETE_SEARCH_ID[] =
+	"DELETE FROM REMOTE_SEARCH WHERE docid = ?;";
+
+/* docid lookups, FTS4 doesn't use docid ranges */
+const char DELETE_REMOTE_SEARCH[] =
+	"DELETE FROM REMOTE_SEARCH WHERE docid IN "
+	"(SELECT PKG_ID FROM REPO_PKG WHERE PKG_ID BETWEEN %d AND %d);";
+
+const char DELETE_UNSEEN_SEARCH[] =
+	"DELETE FROM REMOTE_SEARCH WHERE docid IN "
+	"(SELECT PKG_ID FROM REPO_PKG WHERE PKG_ID BETWEEN %d AND %d "
+	"AND PKG_ID NOT IN (SELECT PKG_ID FROM REMOTE_SEEN));";
+
+/* best matches last, pdb_rec_list() builds the list backwards */
+const char SEARCH_REMOTE_PKGS[] =
+	"SELECT FULLPKGNAME,PKGNAME,PKGVERS,COMMENT,FILE_SIZE,SIZE_PKG "
+	"FROM REMOTE_PKG JOIN "
+	"(SELECT docid, pdb_rank(matchinfo(REMOTE_SEARCH, 'pcx')) AS RANK "
+	"FROM REMOTE_SEARCH WHERE REMOTE_SEARCH MATCH '%s') "
+	"ON REMOTE_PKG.PKG_ID = docid "
+	"ORDER BY RANK ASC, FULLPKGNAME DESC;";
+
+/*
+ * prebuilt catalog: a database holding a single repository's REPO_PKG
+ * and REMOTE_* tables, attached as "catalog", PKG_ID numbered from 1.
+ * See export_catalog().
+ */
+const char CREATE_CATALOG[] =
+	"CREATE TABLE CATALOG_INFO (CATALOG_VERSION INTEGER, "
+	"CATALOG_GEN TEXT, CATALOG_PKGS INTEGER, CATALOG_DATE INTEGER);"
+	"CREATE TABLE CATALOG_SEARCH (PKG_ID INTEGER PRIMARY KEY, "
+	"PKGNAME TEXT, COMMENT TEXT, DESCRIPTION TEXT);";
+
+/* views and explicit indexes, left out of a catalog */
+const char CATALOG_NON_TABLES[] =
+	"SELECT type, name FROM sqlite_master "
+	"WHERE type IN ('view', 'index', 'trigger') AND sql IS NOT NULL;";
+
+/* anything in an attached catalog but the tables it's made of */
+const char CATALOG_UNEXPECTED[] =
+	"SELECT COUNT(*) FROM catalog.sqlite_master c "
+	"WHERE NOT (c.type = 'index' AND c.sql IS NULL) "
+	"AND NOT (c.type = 'table' AND c.sql LIKE 'CREATE TABLE %' "
+	"AND (c.name IN ('CATALOG_INFO', 'CATALOG_SEARCH') "
+	"OR c.name IN (SELECT name FROM main.sqlite_master "
+	"WHERE type = 'table' AND sql LIKE 'CREATE TABLE %')));";
+
+const char CATALOG_INFO[] =
+	"SELECT CATALOG_VERSION, CATALOG_GEN, CATALOG_PKGS "
+	"FROM catalog.CATALOG_INFO;";
+
+const char INSERT_CATALOG_INFO[] =
+	"INSERT INTO catalog.CATALOG_INFO VALUES (%d, '%s', "
+	"(SELECT COUNT(*) FROM catalog.REPO_PKG), %lld);";
+
+const char EXPORT_CATALOG_TBL[] =
+	"INSERT INTO catalog.%s (%s) SELECT %s FROM main.%s "
+	"WHERE PKG_ID BETWEEN %d AND %d;";
+
+const char IMPORT_CATALOG_TBL[] =
+	"INSERT INTO main.%s (%s) SELECT %s FROM catalog.%s;";
+
+const char CATALOG_PKG_HASHES[] =
+	"SELECT PKG_HASH FROM catalog.REPO_PKG;";
+
+const char EXPORT_CATALOG_SEARCH[] =
+	"INSERT INTO catalog.CATALOG_SEARCH "
+	"SELECT docid - %d, PKGNAME, COMMENT, DESCRIPTION "
+	"FROM main.REMOTE_SEARCH WHERE docid IN "
+	"(SELECT PKG_ID + %d FROM catalog.REPO_PKG);";
+
+/* a catalog built without search index still gets names and comments */
+const char IMPORT_CATALOG_SEARCH[] =
+	"INSERT INTO main.REMOTE_SEARCH (docid, PKGNAME, COMMENT, DESCRIPTION) "
+	"SELECT p.PKG_ID + %d, IFNULL(s.PKGNAME, p.PKGNAME), "
+	"IFNULL(s.COMMENT, p.COMMENT), s.DESCRIPTION "
+	"FROM catalog.REPO_PKG p LEFT JOIN catalog.CATALOG_SEARCH s "
+	"ON s.PKG_ID = p.PKG_ID;";
+
+const char IMPORT_CATALOG_SEARCH_SLIM[] =
+	"INSERT INTO main.REMOTE_SEARCH (docid, PKGNAME, COMMENT) "
+	"SELECT PKG_ID + %d, PKGNAME, COMMENT FROM catalog.REPO_PKG;";
@@ -271,51 +271,123 @@ list_pkgs(const char *pkgquery, int lstype)
 	free_pkglist(&plisthead, LIST);
 }
 
+/* print a search result with its installed status */
+static void
+print_match(Pkglist *plist)
+{
+	int		rc;
+	char	is_inst = '\0', outpkg[BUFSIZ];
+
+	if (!SLIST_EMPTY(&l_plisthead)) {
+		rc = pkg_is_installed(&l_plisthead, plist);
+
+		if (rc == 0)
+			is_inst = PKG_EQUAL;
+		if (rc == 1)
+			is_inst = PKG_GREATER;
+		if (rc == 2)
+			is_inst = PKG_LESSER;
+	}
+
+	snprintf(outpkg, BUFSIZ, "%s %c", plist->full, is_inst);
+
+	printf("%-20s %s\n", outpkg, plist->comment);
+}
+
+/**
+ * \fn search_match
+ *
+ * \brief turn a plain pattern to a REMOTE_SEARCH MATCH expression, every
+ * word being a prefix phrase: py27-foo bar becomes "py27 foo*" "bar*".
+ * NULL if pattern looks like a regular expression.
+ */
+static char *
+search_match(const char *pattern, char *match, size_t size)
+{
+	const char	*p;
+	size_t		len = 0;
+	uint8_t		inword = 0, intoken = 0;
+
+	for (p = pattern; *p != '\0'; p++) {
+		/* room for the longest append and the closing "*\"" */
+		if (len + 6 > size)
+			return NULL;
+
+		if (isalnum((unsigned char)*p)) {
+			if (!inword)
+				match[len++] = '"';
+			else if (!intoken)
+				match[len++] = ' ';
+			match[len++] = *p;
+			inword = intoken = 1;
+		} else if (*p == '-' || *p == '_')
+			intoken = 0;
+		else if (*p == ' ') {
+			if (inword) {
+				memcpy(match + len, "*\" ", 3);
+				len += 3;
+			}
+			inword = intoken = 0;
+		} else
+			return NULL;
+	}
+
+	if (inword) {
+		memcpy(match + len, "*\"", 2);
+		len += 2;
+	}
+	match[len] = '\0';
+
+	return len > 0 ? match : NULL;
+}
+
+/**
+ * \fn search_pkg
+ *
+ * \brief search package names, comments and descriptions through the
+ * full-text index. Regular expressions, or patterns the index has
+ * nothing for, are matched against names and comments.
+ */
 void
 search_pkg(const char *pattern)
 {
 	Pkglist	   	*plist;
+	Plisthead	*plisthead;
 	regex_t		re;
 	int			rc;
-	char		eb[64], is_inst, outpkg[BUFSIZ];
+	char		eb[64], match[BUFSIZ];
 	int			matched_pkgs;
 
 	matched_pkgs = 0;
 
 	if (!SLIST_EMPTY(&r_plisthead)) {
-		if ((rc = regcomp(&re, pattern, REG_EXTENDED|REG_NOSUB|REG_ICASE))
-			!= 0) {
-			regerror(rc, &re, eb, sizeof(eb));
-			errx(1, "regcomp: %s: %s", pattern, eb);
-		}
-
-		SLIST_FOREACH(plist, &r_plisthead, next) {
-			is_inst = '\0';
-
-			if (regexec(&re, plist->name, 0, NULL, 0) == 0 ||
-				regexec(&re, plist->comment, 0, NULL, 0) == 0) {
-
+		if (search_match(pattern, match, sizeof(match)) != NULL &&
+			(plisthead = rec_pkglist(SEARCH_REMOTE_PKGS, match)) != NULL) {
+			SLIST_FOREACH(plist, plisthead, next) {
 				matched_pkgs = 1;
+				print_match(plist);
+			}
 
-				if (!SLIST_EMPTY(&l_plisthead)) {
-					rc = pkg_is_installed(&l_plisthead, plist);
+			free_pkglist(&plisthead, LIST);
+		}
 
-					if (rc == 0)
-						is_inst = PKG_EQUAL;
-					if (rc == 1)
-						is_inst = PKG_GREATER;
-					if (rc == 2)
-						is_inst = PKG_LESSER;
+		if (!matched_pkgs) {
+			if ((rc = regcomp(&re, pattern,
+						REG_EXTENDED|REG_NOSUB|REG_ICASE)) != 0) {
+				regerror(rc, &re, eb, sizeof(eb));
+				errx(1, "regcomp: %s: %s", pattern, eb);
+			}
 
+			SLIST_FOREACH(plist, &r_plisthead, next) {
+				if (regexec(&re, plist->name, 0, NULL, 0) == 0 ||
+					regexec(&re, plist->comment, 0, NULL, 0) == 0) {
+					matched_pkgs = 1;
+					print_match(plist);
 				}
-
-				snprintf(outpkg, BUFSIZ, "%s %c", plist->full, is_inst);
-
-				printf("%-20s %s\n", outpkg, plist->comment);
 			}
-		}
 
-		regfree(&re);
+			regfree(&re);
+		}
 
 		if (matched_pkgs == 1)
 			printf(MSG_IS_INSTALLED_CODE);
@@ -0,0 +1,960 @@
+/* $Id$ */
+
+/*
+ * Copyright (c) 2009, 2010 The NetBSD Foundation, Inc.
+ * All rights reserved.
+ *
+ * This code is derived from software contributed to The NetBSD Foundation
+ * by Emile "iMil" Heitor <imil@NetBSD.org> .
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+
+/**
+ * Streaming pkg_summary reader
+ *
+ * A summary flows through fetchIO (or a pipe for the local summary),
+ * an incremental zstd / xz / bzip2 / zlib decompressor and a line
+ * splitter, each stage working on SUM_CHUNK bytes at a time. Memory
+ * usage thus does not depend on the repository size, and the database
+ * is fed while the transfer is still running. Large bzip2 summaries are
+ * the exception, read whole and decoded in parallel, see bzpar.c.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <bzlib.h>
+#include <zlib.h>
+/* before pkgin.h, its macros clash with lzma.h prototypes */
+#ifdef HAVE_LIBLZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+#include "pkgin.h"
+
+#define SUM_CHUNK	65536
+#define SUM_MAP_CHUNK	(SUM_CHUNK * 256) /* mapped file window */
+#define SUM_BZPAR_MIN	(256 * 1024) /* bzip2 decoded in parallel above */
+
+#define SUM_PLAIN	0
+#define SUM_BZIP2	1
+#define SUM_GZIP	2
+#define SUM_XZ		3
+#define SUM_ZSTD	4
+
+struct Sumstream {
+	fetchIO		*f; /*!< remote pkg_summary */
+	FILE		*fp; /*!< local command output or spool file */
+	char		*map; /*!< file:// summary, see sum_open_file() */
+	char		*raw; /*!< whole raw input read to memory, map over it */
+	size_t		map_len;
+	size_t		map_pos;
+	uint8_t		pipe; /*!< fp comes from popen() */
+	int			comp; /*!< compression type */
+	uint8_t		eof; /*!< raw input exhausted */
+	uint8_t		end; /*!< decompressed output exhausted */
+	bz_stream	bz;
+	Bzpar		*bzp; /*!< parallel bzip2 decoder, see sum_bzpar() */
+	z_stream	z;
+#ifdef HAVE_LIBLZMA
+	lzma_stream	lz;
+#endif
+#ifdef HAVE_LIBZSTD
+	ZSTD_DStream	*zs;
+	ZSTD_inBuffer	zin;
+	size_t		zhint; /*!< last ZSTD_decompressStream() result */
+	uint8_t		zfull; /*!< output buffer filled, flush pending */
+#endif
+	char		*in; /*!< raw input chunk, in inbuf or map */
+	size_t		in_len;
+	char		*inbuf;
+	char		*out; /*!< decompressed chunk, in outbuf or input if plain */
+	char		*outbuf;
+	size_t		out_len;
+	size_t		out_pos;
+	char		*line; /*!< current line, grows to the longest one */
+	size_t		line_size;
+	uint8_t		spool; /*!< reads a spool file, see sum_spool() */
+	off_t		raw_size; /*!< raw input size, -1 if unknown */
+	off_t		raw_read;
+	off_t		out_total; /*!< decompressed bytes, this stream's */
+	Sumstats	st; /*!< transfer and decompression, see sum_stats() */
+};
+
+/* read next raw chunk to buf */
+static size_t
+sum_read_raw(Sumstream *s, char *buf, size_t len)
+{
+	ssize_t	r;
+	double	t;
+
+	if (s->eof)
+		return 0;
+
+	t = time_sec();
+
+	if (s->map != NULL) {
+		/* only used to tell the end of a mapping */
+		r = 0;
+	} else if (s->f != NULL) {
+		/* not fetchLastErrString, other workers may have changed it */
+		if ((r = fetchIO_read(s->f, buf, len)) < 0)
+			errx(EXIT_FAILURE, "failure during fetch of file: %s",
+				strerror(errno));
+	} else
+		r = fread(buf, 1, len, s->fp);
+
+	if (r == 0)
+		s->eof = 1;
+
+	s->raw_read += r;
+	if (!s->spool) {
+		s->st.fetched += r;
+		s->st.fetch_time += time_sec() - t;
+	}
+
+	return (size_t)r;
+}
+
+/*
+ * next raw chunk to s->in: a window over a mapped file, which is not
+ * copied, or what's read to inbuf. Returns its length.
+ */
+static size_t
+sum_next_in(Sumstream *s)
+{
+	size_t	len;
+
+	if (s->map == NULL || s->map_pos == s->map_len) {
+		s->in = s->inbuf;
+		s->in_len = sum_read_raw(s, s->in, SUM_CHUNK);
+
+		return s->in_len;
+	}
+
+	len = s->map_len - s->map_pos;
+	if (len > SUM_MAP_CHUNK)
+		len = SUM_MAP_CHUNK;
+
+	s->in = s->map + s->map_pos;
+	s->in_len = len;
+	s->map_pos += len;
+
+	/* unless it was read already, see sum_slurp() */
+	if (s->raw == NULL) {
+		s->raw_read += len;
+		if (!s->spool)
+			s->st.fetched += len;
+	}
+
+	return len;
+}
+
+static void
+sum_init_decomp(Sumstream *s)
+{
+	switch (s->comp) {
+	case SUM_BZIP2:
+		memset(&s->bz, 0, sizeof(bz_stream));
+		if (BZ2_bzDecompressInit(&s->bz, 0, 0) != BZ_OK)
+			errx(EXIT_FAILURE, "BZ2_bzDecompressInit failed");
+		break;
+	case SUM_GZIP:
+		memset(&s->z, 0, sizeof(z_stream));
+		if (inflateInit2(&s->z, 47) != Z_OK)
+			errx(EXIT_FAILURE, "inflateInit failed");
+		break;
+#ifdef HAVE_LIBLZMA
+	case SUM_XZ:
+		memset(&s->lz, 0, sizeof(lzma_stream));
+		if (lzma_stream_decoder(&s->lz, UINT64_MAX, LZMA_CONCATENATED)
+			!= LZMA_OK)
+			errx(EXIT_FAILURE, "lzma_stream_decoder failed");
+		break;
+#endif
+#ifdef HAVE_LIBZSTD
+	case SUM_ZSTD:
+		if ((s->zs = ZSTD_createDStream()) == NULL ||
+			ZSTD_isError(ZSTD_initDStream(s->zs)))
+			errx(EXIT_FAILURE, "ZSTD_initDStream failed");
+		break;
+#endif
+	}
+}
+
+static void
+sum_end_decomp(Sumstream *s)
+{
+	switch (s->comp) {
+	case SUM_BZIP2:
+		BZ2_bzDecompressEnd(&s->bz);
+		break;
+	case SUM_GZIP:
+		inflateEnd(&s->z);
+		break;
+#ifdef HAVE_LIBLZMA
+	case SUM_XZ:
+		lzma_end(&s->lz);
+		break;
+#endif
+#ifdef HAVE_LIBZSTD
+	case SUM_ZSTD:
+		ZSTD_freeDStream(s->zs);
+		break;
+#endif
+	}
+}
+
+/*
+ * read the rest of a transfer of known size to s->raw, the first chunk
+ * being in s->in already. s->map then windows over what follows it.
+ */
+static void
+sum_slurp(Sumstream *s)
+{
+	size_t	size, len, r;
+
+	size = s->raw_size > (off_t)s->in_len ? s->raw_size : s->in_len + 1;
+	XMALLOC(s->raw, size);
+	memcpy(s->raw, s->in, s->in_len);
+	len = s->in_len;
+
+	for (;;) {
+		if (len == size) {
+			size *= 2;
+			XREALLOC(s->raw, size);
+		}
+		if ((r = sum_read_raw(s, s->raw + len, size - len)) == 0)
+			break;
+		len += r;
+	}
+
+	s->map = s->raw;
+	s->map_len = len;
+	s->map_pos = s->in_len;
+}
+
+/*
+ * large bzip2 summaries are decoded block by block on every CPU, which
+ * needs the whole compressed input at hand. Any layout bzpar_open()
+ * can't split is left to sum_bzip2(), which goes on from s->in.
+ */
+static void
+sum_bzpar(Sumstream *s)
+{
+	long	ncpu;
+
+	if (s->raw_size < SUM_BZPAR_MIN)
+		return;
+
+	if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 2)
+		return;
+
+	if (s->map == NULL)
+		sum_slurp(s);
+
+	if ((s->bzp = bzpar_open(s->map, s->map_len, ncpu)) == NULL)
+		return;
+
+	/* all of it is read by bzpar */
+	if (s->raw == NULL) {
+		s->raw_read += s->map_len - s->map_pos;
+		s->st.fetched += s->map_len - s->map_pos;
+	}
+	s->map_pos = s->map_len;
+}
+
+/* guess compression from the magic of the first chunk */
+static void
+sum_detect(Sumstream *s)
+{
+	size_t	r;
+
+	if (s->map != NULL)
+		sum_next_in(s);
+	else
+		while (s->in_len < 6 && (r = sum_read_raw(s,
+			s->in + s->in_len, SUM_CHUNK - s->in_len)) > 0)
+			s->in_len += r;
+
+	if (s->in_len >= 4 &&
+		s->in[0] == 'B' && s->in[1] == 'Z' && s->in[2] == 'h' &&
+		s->in[3] >= '1' && s->in[3] <= '9')
+		s->comp = SUM_BZIP2;
+	else if (s->in_len >= 4 &&
+		s->in[0] == 037 && (unsigned char)s->in[1] == 139 &&
+		s->in[2] == 8 && (s->in[3] & 0xe0) == 0)
+		s->comp = SUM_GZIP;
+	else if (s->in_len >= 6 && memcmp(s->in, "\3757zXZ\0", 6) == 0)
+		s->comp = SUM_XZ;
+	else if (s->in_len >= 4 && memcmp(s->in, "\050\265\057\375", 4) == 0)
+		s->comp = SUM_ZSTD;
+	else
+		s->comp = SUM_PLAIN;
+
+#ifndef HAVE_LIBLZMA
+	if (s->comp == SUM_XZ)
+		errx(EXIT_FAILURE, "xz compression is not supported");
+#endif
+#ifndef HAVE_LIBZSTD
+	if (s->comp == SUM_ZSTD)
+		errx(EXIT_FAILURE, "zstd compression is not supported");
+#endif
+
+	sum_init_decomp(s);
+
+	switch (s->comp) {
+	case SUM_PLAIN:
+		/* already readable text */
+		s->out = s->in;
+		s->out_len = s->in_len;
+		s->out_total = s->out_len;
+		if (!s->spool)
+			s->st.size = s->out_len;
+		break;
+	case SUM_BZIP2:
+		s->bz.next_in = s->in;
+		s->bz.avail_in = s->in_len;
+		sum_bzpar(s);
+		break;
+	case SUM_GZIP:
+		s->z.next_in = (unsigned char *)s->in;
+		s->z.avail_in = s->in_len;
+		break;
+#ifdef HAVE_LIBLZMA
+	case SUM_XZ:
+		s->lz.next_in = (uint8_t *)s->in;
+		s->lz.avail_in = s->in_len;
+		break;
+#endif
+#ifdef HAVE_LIBZSTD
+	case SUM_ZSTD:
+		s->zin.src = s->in;
+		s->zin.size = s->in_len;
+		s->zin.pos = 0;
+		break;
+#endif
+	}
+}
+
+static Sumstream *
+sum_alloc(void)
+{
+	Sumstream	*s;
+
+	XMALLOC(s, sizeof(Sumstream));
+	XMALLOC(s->inbuf, SUM_CHUNK);
+	XMALLOC(s->outbuf, SUM_CHUNK);
+	s->in = s->inbuf;
+	s->out = s->outbuf;
+	s->line_size = BUFSIZ;
+	XMALLOC(s->line, s->line_size);
+	s->raw_size = -1;
+
+	return s;
+}
+
+/**
+ * \fn sum_open_file
+ *
+ * \brief map a file:// repository summary, it is then decompressed or
+ * parsed in place, without being copied
+ */
+static Sumstream *
+sum_open_file(const char *path, time_t *db_mtime)
+{
+	Sumstream	*s;
+	struct stat	st;
+	void		*map = MAP_FAILED;
+	int			fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	/* same as fetch_url() */
+	if (*db_mtime > 0 && st.st_mtime <= *db_mtime) {
+		*db_mtime = -1;
+		close(fd);
+		return NULL;
+	}
+	*db_mtime = st.st_mtime;
+
+	s = sum_alloc();
+	s->raw_size = st.st_size;
+
+	if (st.st_size > 0)
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	if (map != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+		(void)madvise(map, st.st_size, MADV_SEQUENTIAL);
+#endif
+		s->map = map;
+		s->map_len = st.st_size;
+		close(fd);
+	} else if ((s->fp = fdopen(fd, "r")) == NULL)
+		err(EXIT_FAILURE, "can't read %s", path);
+
+	sum_detect(s);
+
+	return s;
+}
+
+/**
+ * \fn sum_open
+ *
+ * \brief open a remote pkg_summary for streaming
+ *
+ * db_mtime semantics are the same as download_file()'s, errcode is set
+ * as by fetch_url()
+ */
+Sumstream *
+sum_open(char *str_url, time_t *db_mtime, int *errcode)
+{
+	Sumstream	*s;
+	fetchIO		*f;
+	off_t		size;
+
+	if (strncmp(str_url, SCHEME_FILE "://", strlen(SCHEME_FILE) + 3) == 0) {
+		*errcode = 0;
+		if ((s = sum_open_file(&str_url[strlen(SCHEME_FILE) + 3],
+				db_mtime)) == NULL && *db_mtime >= 0)
+			*errcode = FETCH_UNAVAIL;
+		return s;
+	}
+
+	if ((f = fetch_url(str_url, db_mtime, &size, errcode)) == NULL)
+		return NULL;
+
+	s = sum_alloc();
+	s->f = f;
+	s->raw_size = size;
+	sum_detect(s);
+
+	return s;
+}
+
+/**
+ * \fn sum_open_cmd
+ *
+ * \brief stream the output of a command generating a summary
+ */
+Sumstream *
+sum_open_cmd(const char *cmd)
+{
+	Sumstream	*s;
+	FILE		*fp;
+
+	if ((fp = popen(cmd, "r")) == NULL)
+		return NULL;
+
+	s = sum_alloc();
+	s->fp = fp;
+	s->pipe = 1;
+	sum_detect(s);
+
+	return s;
+}
+
+void
+sum_close(Sumstream *s)
+{
+	if (s == NULL)
+		return;
+
+	sum_end_decomp(s);
+	bzpar_close(s->bzp);
+
+	if (s->f != NULL)
+		fetchIO_close(s->f);
+	if (s->fp != NULL) {
+		if (s->pipe)
+			pclose(s->fp);
+		else
+			fclose(s->fp);
+	}
+
+	if (s->raw != NULL)
+		XFREE(s->raw);
+	else if (s->map != NULL)
+		munmap(s->map, s->map_len);
+
+	XFREE(s->inbuf);
+	XFREE(s->outbuf);
+	XFREE(s->line);
+	XFREE(s);
+}
+
+/*
+ * a compressed stream just ended, is there another one behind it ?
+ * if the current chunk is consumed, read the next one to s->in
+ */
+static int
+sum_more_input(Sumstream *s, size_t avail_in)
+{
+	if (avail_in > 0)
+		return 1;
+
+	return sum_next_in(s) > 0;
+}
+
+/* inflate next bzip2 chunk, returns 0 at end of stream */
+static int
+sum_bzip2(Sumstream *s)
+{
+	int	rc;
+
+	if (s->bzp != NULL) {
+		if ((rc = bzpar_read(s->bzp, &s->out, &s->out_len)) < 0)
+			errx(EXIT_FAILURE, "inflate failed");
+		if (rc == 0)
+			s->end = 1;
+		return rc;
+	}
+
+	for (;;) {
+		if (s->bz.avail_in == 0) {
+			sum_next_in(s);
+			s->bz.next_in = s->in;
+			s->bz.avail_in = s->in_len;
+		}
+
+		s->bz.next_out = s->out;
+		s->bz.avail_out = SUM_CHUNK;
+
+		rc = BZ2_bzDecompress(&s->bz);
+		s->out_len = SUM_CHUNK - s->bz.avail_out;
+
+		switch (rc) {
+		case BZ_STREAM_END:
+			/* concatenated streams, as produced by parallel bzip2 */
+			if (sum_more_input(s, s->bz.avail_in)) {
+				char		*next_in = s->bz.next_in;
+				unsigned	avail_in = s->bz.avail_in;
+
+				if (avail_in == 0) {
+					next_in = s->in;
+					avail_in = s->in_len;
+				}
+				BZ2_bzDecompressEnd(&s->bz);
+				sum_init_decomp(s);
+				s->bz.next_in = next_in;
+				s->bz.avail_in = avail_in;
+			} else
+				s->end = 1;
+			break;
+		case BZ_OK:
+			if (s->bz.avail_in == 0 && s->eof && s->out_len == 0)
+				errx(EXIT_FAILURE, "truncated file");
+			break;
+		default:
+			errx(EXIT_FAILURE, "inflate failed");
+		}
+
+		if (s->out_len > 0 || s->end)
+			return s->out_len > 0;
+	}
+}
+
+/* inflate next gzip chunk, returns 0 at end of stream */
+static int
+sum_gzip(Sumstream *s)
+{
+	int	rc;
+
+	for (;;) {
+		if (s->z.avail_in == 0) {
+			sum_next_in(s);
+			s->z.next_in = (unsigned char *)s->in;
+			s->z.avail_in = s->in_len;
+		}
+
+		s->z.next_out = (unsigned char *)s->out;
+		s->z.avail_out = SUM_CHUNK;
+
+		rc = inflate(&s->z, Z_NO_FLUSH);
+		s->out_len = SUM_CHUNK - s->z.avail_out;
+
+		switch (rc) {
+		case Z_STREAM_END:
+			/* gzip files may hold more than one member */
+			if (sum_more_input(s, s->z.avail_in)) {
+				if (s->z.avail_in == 0) {
+					s->z.next_in = (unsigned char *)s->in;
+					s->z.avail_in = s->in_len;
+				}
+				if (inflateReset(&s->z) != Z_OK)
+					errx(EXIT_FAILURE, "inflateReset failed");
+			} else
+				s->end = 1;
+			break;
+		case Z_OK:
+			break;
+		case Z_BUF_ERROR:
+			/* no progress possible: input exhausted */
+			if (s->eof)
+				errx(EXIT_FAILURE, "truncated file");
+			break;
+		default:
+			errx(EXIT_FAILURE, "inflate failed");
+		}
+
+		if (s->out_len > 0 || s->end)
+			return s->out_len > 0;
+	}
+}
+
+#ifdef HAVE_LIBLZMA
+/* decode next xz chunk, returns 0 at end of stream */
+static int
+sum_xz(Sumstream *s)
+{
+	lzma_ret	rc;
+
+	for (;;) {
+		if (s->lz.avail_in == 0 && !s->eof) {
+			sum_next_in(s);
+			s->lz.next_in = (uint8_t *)s->in;
+			s->lz.avail_in = s->in_len;
+		}
+
+		s->lz.next_out = (uint8_t *)s->out;
+		s->lz.avail_out = SUM_CHUNK;
+
+		/* LZMA_CONCATENATED decoder: only ends with LZMA_FINISH */
+		rc = lzma_code(&s->lz, s->eof ? LZMA_FINISH : LZMA_RUN);
+		s->out_len = SUM_CHUNK - s->lz.avail_out;
+
+		switch (rc) {
+		case LZMA_STREAM_END:
+			s->end = 1;
+			break;
+		case LZMA_OK:
+			break;
+		case LZMA_BUF_ERROR:
+			errx(EXIT_FAILURE, "truncated file");
+		default:
+			errx(EXIT_FAILURE, "xz decoding failed");
+		}
+
+		if (s->out_len > 0 || s->end)
+			return s->out_len > 0;
+	}
+}
+#endif
+
+#ifdef HAVE_LIBZSTD
+/* decode next zstd chunk, returns 0 at end of stream */
+static int
+sum_zstd(Sumstream *s)
+{
+	ZSTD_outBuffer	out;
+
+	for (;;) {
+		if (s->zin.pos == s->zin.size && !s->zfull) {
+			if (s->eof) {
+				/* a non-zero hint means the last frame is incomplete */
+				if (s->zhint != 0)
+					errx(EXIT_FAILURE, "truncated file");
+				s->end = 1;
+				return 0;
+			}
+			sum_next_in(s);
+			s->zin.src = s->in;
+			s->zin.size = s->in_len;
+			s->zin.pos = 0;
+			continue;
+		}
+
+		out.dst = s->out;
+		out.size = SUM_CHUNK;
+		out.pos = 0;
+
+		/* concatenated frames are decoded one after the other */
+		s->zhint = ZSTD_decompressStream(s->zs, &out, &s->zin);
+		if (ZSTD_isError(s->zhint))
+			errx(EXIT_FAILURE, "zstd decoding failed: %s",
+				ZSTD_getErrorName(s->zhint));
+
+		s->zfull = out.pos == out.size;
+		s->out_len = out.pos;
+
+		if (s->out_len > 0)
+			return 1;
+	}
+}
+#endif
+
+/* decompress next chunk to s->out, returns 0 when there's nothing left */
+static int
+sum_decomp(Sumstream *s)
+{
+	s->out_pos = 0;
+	s->out_len = 0;
+
+	if (s->end)
+		return 0;
+
+	switch (s->comp) {
+	case SUM_BZIP2:
+		return sum_bzip2(s);
+	case SUM_GZIP:
+		return sum_gzip(s);
+#ifdef HAVE_LIBLZMA
+	case SUM_XZ:
+		return sum_xz(s);
+#endif
+#ifdef HAVE_LIBZSTD
+	case SUM_ZSTD:
+		return sum_zstd(s);
+#endif
+	}
+
+	/* plain text is read where it lies */
+	if ((s->out_len = sum_next_in(s)) == 0)
+		s->end = 1;
+	s->out = s->in;
+
+	return s->out_len > 0;
+}
+
+/* refill the decompressed chunk, returns 0 when there's nothing left */
+static int
+sum_fill(Sumstream *s)
+{
+	double	t = time_sec();
+	int		rc;
+
+	rc = sum_decomp(s);
+
+	s->out_total += s->out_len;
+	if (!s->spool) {
+		s->st.size += s->out_len;
+		s->st.fill_time += time_sec() - t;
+	}
+
+	return rc;
+}
+
+/**
+ * \fn sum_spool
+ *
+ * \brief decompress s to a temporary file and return a stream reading it
+ *
+ * s is closed. This lets the transfer and decompression of a summary run
+ * ahead of its import to the database. A mapped plain summary is already
+ * there, s is returned as is.
+ */
+Sumstream *
+sum_spool(Sumstream *s)
+{
+	Sumstream	*spool;
+	FILE		*fp;
+	off_t		size;
+
+	if (s->map != NULL && s->comp == SUM_PLAIN)
+		return s;
+
+	if ((fp = tmpfile()) == NULL)
+		err(EXIT_FAILURE, "tmpfile()");
+
+	do {
+		if (fwrite(s->out + s->out_pos, 1, s->out_len - s->out_pos, fp)
+			!= s->out_len - s->out_pos)
+			err(EXIT_FAILURE, "can't write summary spool");
+	} while (sum_fill(s));
+
+	size = ftello(fp);
+	rewind(fp);
+
+	spool = sum_alloc();
+	spool->fp = fp;
+	spool->spool = 1;
+	spool->raw_size = size;
+	spool->st = s->st;
+	sum_close(s);
+	sum_detect(spool);
+
+	return spool;
+}
+
+/* raw input not consumed by the decompressor yet */
+static size_t
+sum_decomp_pending(Sumstream *s)
+{
+	switch (s->comp) {
+	case SUM_BZIP2:
+		return s->bz.avail_in;
+	case SUM_GZIP:
+		return s->z.avail_in;
+#ifdef HAVE_LIBLZMA
+	case SUM_XZ:
+		return s->lz.avail_in;
+#endif
+#ifdef HAVE_LIBZSTD
+	case SUM_ZSTD:
+		return s->zin.size - s->zin.pos;
+#endif
+	}
+
+	return 0;
+}
+
+/* raw input read but not consumed yet */
+static size_t
+sum_pending(Sumstream *s)
+{
+	/* read ahead by sum_slurp() */
+	if (s->raw != NULL)
+		return s->map_len - s->map_pos + sum_decomp_pending(s);
+
+	return sum_decomp_pending(s);
+}
+
+/**
+ * \fn sum_progress
+ *
+ * \brief percentage of s returned by sum_getline(), -1 if unknown
+ *
+ * This is exact for uncompressed summaries, spooled ones included. A
+ * compressed stream can only tell how much of its input was inflated.
+ */
+int
+sum_progress(Sumstream *s)
+{
+	off_t	done;
+
+	if (s->raw_size <= 0)
+		return -1;
+
+	if (s->comp == SUM_PLAIN)
+		done = s->out_total - (off_t)(s->out_len - s->out_pos);
+	else if (s->bzp != NULL)
+		done = bzpar_done(s->bzp);
+	else
+		done = s->raw_read - (off_t)sum_pending(s);
+
+	if (done >= s->raw_size)
+		return 100;
+
+	return (int)(done * 100 / s->raw_size);
+}
+
+/**
+ * \fn sum_stats
+ *
+ * \brief add s transfer and decompression statistics to st
+ */
+void
+sum_stats(Sumstream *s, Sumstats *st)
+{
+	st->fetched += s->st.fetched;
+	st->size += s->st.size;
+	st->fetch_time += s->st.fetch_time;
+	st->fill_time += s->st.fill_time;
+}
+
+/**
+ * \fn sum_read
+ *
+ * \brief copy up to len bytes of s to buf, for the files which are not
+ * read by lines. Returns the number of bytes copied, 0 at the end.
+ */
+size_t
+sum_read(Sumstream *s, char *buf, size_t len)
+{
+	size_t	n;
+
+	if (s->out_pos == s->out_len && !sum_fill(s))
+		return 0;
+
+	n = s->out_len - s->out_pos;
+	if (n > len)
+		n = len;
+
+	memcpy(buf, s->out + s->out_pos, n);
+	s->out_pos += n;
+
+	return n;
+}
+
+/**
+ * \fn sum_getline
+ *
+ * \brief return next summary line, without leading blanks nor newline
+ *
+ * An empty string marks the end of a package record, NULL the end of
+ * the summary. The returned buffer is only valid until the next call.
+ */
+char *
+sum_getline(Sumstream *s)
+{
+	char	*p, *start;
+	size_t	len, linelen = 0;
+
+	for (;;) {
+		if (s->out_pos == s->out_len && !sum_fill(s)) {
+			if (linelen == 0)
+				return NULL;
+			/* last line has no newline */
+			break;
+		}
+
+		start = s->out + s->out_pos;
+		p = memchr(start, '\n', s->out_len - s->out_pos);
+		len = (p != NULL ? p : s->out + s->out_len) - start;
+
+		if (linelen + len + 1 > s->line_size) {
+			while (linelen + len + 1 > s->line_size)
+				s->line_size *= 2;
+			XREALLOC(s->line, s->line_size);
+		}
+		memcpy(s->line + linelen, start, len);
+		linelen += len;
+		s->out_pos += len;
+
+		if (p != NULL) {
+			s->out_pos++; /* skip newline */
+			break;
+		}
+	}
+
+	s->line[linelen] = '\0';
+	trimcr(s->line);
+
+	for (p = s->line; *p == ' ' || *p == '\t'; p++);
+
+	return p;
+}
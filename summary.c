@@ -34,6 +34,9 @@
  * Import pkg_summary to SQLite database
  */
 
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include "tools.h"
 #include "pkgin.h"
 
@@ -57,7 +60,7 @@ static const struct Summary {
 	},
 	[REMOTE_SUMMARY] = {
 		REMOTE_SUMMARY,
-		"REMOTE_PKG",
+		"REPO_PKG", /* every repository's, see REMOTE_PKG */
 		"REMOTE_DEPS",
 		"REMOTE_CONFLICTS",
 		"REMOTE_REQUIRES",
@@ -69,632 +72,2700 @@ static const struct Summary {
 struct Columns {
 	int		num;
 	char	**name;
-} cols;
+};
 
-typedef struct Insertlist {
-	char	*field;
-	char	*value;
-	SLIST_ENTRY(Insertlist) next;
-} Insertlist;
+/* parsed fields types */
+#define FIELD_COL		0 /* main table column */
+#define FIELD_DEPS		1
+#define FIELD_CONFLICTS	2
+#define FIELD_REQUIRES	3
+#define FIELD_PROVIDES	4
+/* keys only, never recorded as a Field */
+#define FIELD_PKGNAME	5
+#define FIELD_ARCH		6 /* MACHINE_ARCH, checked and recorded as a column */
+#define FIELD_DESCR		7 /* full-text search only */
+#define FIELD_SKIP		8
 
-SLIST_HEAD(, Insertlist) inserthead;
+#define KEYS_SIZE	128 /* power of 2, at least twice the number of keys */
 
-static char		**fetch_summary(char *url);
-static void		freecols(void);
-static void		free_insertlist(void);
-static void		prepare_insert(int, struct Summary, char *);
-int				colnames(void *, int, char **, char **);
+/* repositories ingest profiles, see split_repos() */
+#define PROFILE_FULL	0 /* every known summary field */
+#define PROFILE_SLIM	1 /* what listings, resolution and install read */
 
-char		*env_repos, **pkg_repos;
-char		**commit_list = NULL;
-int			commit_idx = 0;
-int			query_size = BUFSIZ;
-/* column count for table fields, given by colnames callback */
-int			colcount = 0;
-/* force pkg_summary reload */
-int			force_fetch = 0;
+/*
+ * REPO_PKG columns kept by PROFILE_SLIM. Children tables are all kept:
+ * pkg_met_reqs() reads REQUIRES and PROVIDES.
+ */
+static const char *const slim_cols[] = {
+	"PKG_ID", "FULLPKGNAME", "PKGNAME", "PKGVERS", "REPOSITORY", "PKG_HASH",
+	"COMMENT", "FILE_SIZE", "SIZE_PKG", "PKGPATH", NULL
+};
 
-static const char *const sumexts[] = { "bz2", "gz", NULL };
+/**
+ * \struct Key
+ * \brief pkg_summary field name, hashed to what it feeds
+ */
+struct Key {
+	const char	*name; /*!< NULL for an empty slot */
+	size_t		len;
+	int			type;
+	int			col; /*!< column index in Loader cols, or -1 */
+};
 
 /**
- * remote summary fetch
+ * \struct Loader
+ * \brief Prepared INSERT statements for a summary type, compiled once
+ * per update and fed with bound values for every package
  */
-static char **
-fetch_summary(char *cur_repo)
-{
-	/* from pkg_install/files/admin/audit.c */
-	Dlfile	*file = NULL;
-	char	*decompressed_input;
-	size_t	decompressed_len;
-	time_t	sum_mtime;
-	int		i;
-	char	**out, buf[BUFSIZ];
+static struct Loader {
+	struct Columns	cols; /*!< main table columns */
+	struct Key		keys[KEYS_SIZE]; /*!< field name dispatch, open addressing */
+	sqlite3_stmt	*pkg; /*!< main table, one bind per column */
+	sqlite3_stmt	*deps;
+	sqlite3_stmt	*conflicts;
+	sqlite3_stmt	*requires;
+	sqlite3_stmt	*provides;
+	sqlite3_stmt	*search; /*!< REMOTE_SEARCH, NULL without FTS4 */
+	int				pkgid_col; /*!< well known columns indexes */
+	int				fullpkgname_col;
+	int				pkgname_col;
+	int				pkgvers_col;
+	int				comment_col;
+	int				repository_col;
+	int				hash_col;
+	int				mtime_col; /*!< LOCAL_SUMMARY, see struct Pkgdir */
+	int				inode_col;
+	int				info_mtime_col;
+	uint8_t			profile; /*!< the keys were prepared for */
+	/* per-package updates, REMOTE_SUMMARY only */
+	sqlite3_stmt	*lookup; /*!< existing FULLPKGNAME's PKG_ID and hash */
+	sqlite3_stmt	*seen; /*!< record a package kept by this update */
+	sqlite3_stmt	*del[5]; /*!< delete a PKG_ID from every table */
+	sqlite3_stmt	*unindex; /*!< and from REMOTE_SEARCH */
+} loaders[2];
 
-	for (i = 0; sumexts[i] != NULL; i++) { /* try all extensions */
-		if (!force_fetch && !force_update)
-			sum_mtime = pkg_sum_mtime(cur_repo);
-		else
-			sum_mtime = 0; /* 0 sumtime == force reload */
+/**
+ * \struct Field
+ * \brief a parsed summary line, values point to the batch buffer
+ */
+struct Field {
+	int		type;
+	int		col; /*!< FIELD_COL: column index in Loader cols */
+	char	*val; /*!< FIELD_DEPS: pkgname in the batch arena, may be NULL */
+	char	*dewey;
+};
 
-		snprintf(buf, BUFSIZ, "%s/%s.%s", cur_repo, PKG_SUMMARY, sumexts[i]);
+/**
+ * \struct Pkgdir
+ * \brief an installed package and its +CONTENTS snapshot, which tells
+ * if its record has to be read again
+ */
+struct Pkgdir {
+	char	*name; /*!< PKG_DBDIR entry, NULL at the end of a list */
+	int64_t	mtime;
+	int64_t	inode;
+	int64_t	info_mtime; /*!< +INSTALLED_INFO's, 0 if there's none */
+};
 
-		if ((file = download_file(buf, &sum_mtime)) != NULL)
-			break; /* pkg_summary found and not up-to-date */
+/**
+ * \struct Pkgrec
+ * \brief a parsed package record
+ */
+struct Pkgrec {
+	char			*fullpkgname; /*!< NULL if the record has none */
+	char			*pkgname;
+	char			*pkgvers;
+	char			*machine_arch;
+	char			*pkgcomment;
+	char			*descr; /*!< DESCRIPTION lines, joined */
+	uint64_t		hash; /*!< raw record hash, see insert_summary() */
+	struct Pkgdir	*pkgdir; /*!< installed package it was read from */
+	struct Field	*fields; /*!< slice of the batch fields */
+	int				nfields;
+};
 
-		if (sum_mtime < 0) /* pkg_summary found, but up-to-date */
-			return NULL;
-	}
+/**
+ * \struct Arena
+ * \brief bump allocator for the strings derived from a batch, sized
+ * before parsing so it never moves while records point to it
+ */
+struct Arena {
+	char	*buf;
+	size_t	len;
+	size_t	size;
+};
 
-	if (file == NULL) {
-		fprintf(stderr, MSG_COULDNT_FETCH, buf);
+#define RECORDS_PER_BATCH	256
+#define SUM_BATCH_SIZE		(RECORDS_PER_BATCH * 1024)
+#define PARSE_BATCHES		(2 * MAX_PARSE_WORKERS)
 
-		return NULL;
-	}
+#define BATCH_FREE		0 /* being filled by the main thread */
+#define BATCH_QUEUED	1
+#define BATCH_PARSING	2
+#define BATCH_PARSED	3 /* waiting to be written */
 
-	snprintf(buf, BUFSIZ, UPDATE_REPO_MTIME, (long long)sum_mtime, cur_repo);
-	pkgindb_doquery(buf, NULL, NULL);
+/**
+ * \struct Batch
+ * \brief up to RECORDS_PER_BATCH raw records, lines separated by '\n'
+ */
+struct Batch {
+	char			*buf;
+	size_t			len;
+	size_t			size;
+	size_t			*off; /*!< records offsets in buf, nrec + 1 entries */
+	struct Pkgrec	*recs;
+	int				nrec;
+	int				nlines; /*!< upper bound of the number of fields */
+	struct Field	*fields; /*!< every record's fields, nlines entries */
+	int				fieldsize;
+	struct Arena	arena;
+	struct Pkgdir	*pkgs; /*!< installed packages to read first */
+	int				npkgs;
+	char			*meta; /*!< metadata file being read, see read_meta() */
+	size_t			metasize;
+	int				state;
+};
+
+/**
+ * \struct Parsepool
+ * \brief a ring of batches, filled and written by the main thread and
+ * parsed by the workers in ring order
+ */
+static struct Parsepool {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	pthread_t		workers[MAX_PARSE_WORKERS];
+	int				nworkers;
+	struct Batch	batches[PARSE_BATCHES];
+	int				next; /*!< next batch to be parsed */
+	uint8_t			quit;
+	struct Loader	*ld;
+} parsers = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+#define DELTA_OFF	0 /* full load */
+#define DELTA_ON	1 /* per-package update, unlisted packages removed */
+#define DELTA_PATCH	2 /* delta summary, see mkdelta.c */
+
+struct Delta {
+	uint8_t	on; /*!< per-package update, see insert_summary() */
+	int		added;
+	int		changed;
+	int		removed;
+};
 
-	if (decompress_buffer(file->buf, file->size, &decompressed_input,
-			&decompressed_len)) {
+/**
+ * \struct Fetchjob
+ * \brief a repository summary, fetched and decompressed by a worker
+ */
+struct Fetchjob {
+	char		*repo;
+	time_t		sum_mtime; /*!< database mtime in, summary mtime out */
+	char		sumext[SMLLEN]; /*!< extension which worked last time */
+	Sumstream	*summary; /*!< spooled summary, NULL if none */
+	char		gen[SMLLEN]; /*!< generation in the database, see repo_gen() */
+	char		to[SMLLEN]; /*!< generation the repository announces */
+	uint8_t		patch; /*!< summary is a delta from gen to to */
+	uint8_t		catalog; /*!< summary is a prebuilt catalog */
+	uint8_t		no_catalog; /*!< catalog rejected, see update_remotedb() */
+	uint8_t		fresh; /*!< checked less than its TTL ago, not fetched */
+	uint8_t		unreachable; /*!< network failure, see fetch_summary() */
+	uint8_t		probed; /*!< fetch_reachable() checked */
+	uint8_t		profile; /*!< PROFILE_FULL or PROFILE_SLIM */
+	uint8_t		reload; /*!< forced, or loaded with another profile */
+	uint8_t		done;
+};
 
-		out = splitstr(decompressed_input, "\n");
+static struct Fetchpool {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	struct Fetchjob	*jobs;
+	int				njobs;
+	int				next; /*!< next job to be picked by a worker */
+} pool = {
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0
+};
 
-		XFREE(file->buf);
-		XFREE(file);
+/**
+ * \struct Updstats
+ * \brief update_db() per-phase statistics, shown with -V
+ */
+static struct Updstats {
+	Sumstats	sum; /*!< summaries transfer and decompression */
+	int			records; /*!< package records parsed */
+	double		ingest_time; /*!< insert_summary(), parsing and writing */
+	int			rows; /*!< rows inserted, updated or deleted */
+	double		commit_time;
+} stats;
+
+static Sumstream	*fetch_summary(struct Fetchjob *);
+static void		freecols(struct Columns *);
+static int		insert_pkg(int, struct Loader *, struct Pkgrec *, char *);
+static void		parse_finalize(void);
+int				colnames(void *, int, char **, char **);
 
-		return out;
-	}
+char		*env_repos, **pkg_repos;
+/* pkg_repos freshness TTLs in seconds and profiles, see split_repos() */
+static int	*repo_ttls;
+static int	*repo_profiles;
+/* force pkg_summary reload */
+int			force_fetch = 0;
 
-	XFREE(file->buf);
-	XFREE(file);
+/* compressed summaries we can read, in default order of preference */
+static const char *const supported_exts[] = {
+#ifdef HAVE_LIBZSTD
+	"zst",
+#endif
+#ifdef HAVE_LIBLZMA
+	"xz",
+#endif
+	"bz2", "gz", NULL
+};
 
-	return NULL;
-}
+/* extensions to try, see init_sumexts() */
+static const char *sumexts[sizeof(supported_exts) / sizeof(char *)];
 
 /**
- * progress percentage
+ * \fn init_sumexts
+ *
+ * \brief record summary extensions order from PKGIN_SUMEXTS, a space
+ * separated list, or the default order
  */
 static void
-progress(char c)
+init_sumexts(void)
 {
-	const char	*alnum = ALNUM;
-	int 		i, alnumlen = strlen(alnum);
-	float		percent = 0;
+	char	*env, *p, *ext;
+	int		i, n = 0;
 
-	for (i = 0; i < alnumlen; i++)
-		if (c == alnum[i])
-			percent = ((float)(i + 1)/ (float)alnumlen) * 100;
+	if (sumexts[0] != NULL)
+		return;
 
-	printf(MSG_UPDATING_DB_PCT, (int)percent);
-	fflush(stdout);
+	if ((env = getenv("PKGIN_SUMEXTS")) != NULL) {
+		XSTRDUP(p, env);
+		env = p;
+
+		while ((ext = strsep(&p, " ")) != NULL) {
+			if (*ext == '\0')
+				continue;
+			for (i = 0; supported_exts[i] != NULL; i++)
+				if (strcmp(ext, supported_exts[i]) == 0)
+					break;
+			if (supported_exts[i] == NULL)
+				warnx(MSG_UNSUPPORTED_SUMEXT, ext);
+			else if (n < (int)(sizeof(supported_exts) / sizeof(char *)) - 1)
+				sumexts[n++] = supported_exts[i];
+		}
+
+		XFREE(env);
+	}
+
+	if (n == 0)
+		for (; supported_exts[n] != NULL; n++)
+			sumexts[n] = supported_exts[n];
+
+	sumexts[n] = NULL;
 }
 
-/**
- * check if the field is PKGNAME
- */
+/* a fetch failed with code before any server answered */
 static int
-chk_pkgname(char *field, char *last_field)
+fetch_unreachable(int code)
 {
-	if (strncmp(field, "PKGNAME=", 8) == 0)
-		return 1;
-	/* in some very rare cases, CONFLICTS appears *after* PKGNAME */
-	if (strncmp(last_field, "PKGNAME=", 8) != 0 &&
-		/* never seen many CONFLICTS after PKGNAME, but just in case... */
-		strncmp(last_field, "CONFLICTS=", 10) != 0 &&
-		strncmp(field, "CONFLICTS=", 10) == 0)
+	switch (code) {
+	case FETCH_DOWN:
+	case FETCH_NETWORK:
+	case FETCH_RESOLV:
+	case FETCH_TIMEOUT:
 		return 1;
+	}
 
 	return 0;
 }
 
+/* a generation, as written by mkdelta */
+static int
+valid_gen(const char *gen)
+{
+	return strlen(gen) == 16 && strspn(gen, "0123456789abcdef") == 16;
+}
+
 /**
- * returns value for given field
+ * \fn fetch_gen
+ *
+ * \brief read the generation the repository announces in PKG_SUMMARY_GEN
+ * to job->to, left empty if it has none. Returns the libfetch error
+ * code, 0 if the file was read.
  */
-static char *
-field_record(const char *field, char *line)
+static int
+fetch_gen(struct Fetchjob *job)
 {
-	char *pfield;
+	Sumstream	*s;
+	time_t		mtime = 0;
+	int			code;
+	char		*line, buf[BUFSIZ];
 
-	if (strncmp(field, line, strlen(field)) == 0) {
-		pfield = strchr(line, '=');
-		trimcr(pfield++);
+	job->to[0] = '\0';
 
-		return pfield;
-	}
-
-	return NULL;
-}
+	snprintf(buf, BUFSIZ, "%s/%s", job->repo, PKG_SUMMARY_GEN);
 
-static void
-freecols()
-{
-	int i;
+	if ((s = sum_open(buf, &mtime, &code)) == NULL)
+		return code != 0 ? code : FETCH_UNAVAIL;
 
-	for (i = 0; i < cols.num; i++)
-		XFREE(cols.name[i]);
+	line = sum_getline(s);
+	if (line != NULL && valid_gen(line))
+		strlcpy(job->to, line, SMLLEN);
+	sum_close(s);
 
-	XFREE(cols.name);
+	return 0;
 }
 
-static void
-free_insertlist()
+/**
+ * \fn fetch_delta
+ *
+ * \brief fetch the delta from job->gen to the generation the repository
+ * announces in PKG_SUMMARY_GEN
+ *
+ * The repository may have stopped publishing generations, or not that
+ * delta: NULL is then returned and the whole summary is fetched instead.
+ */
+static Sumstream *
+fetch_delta(struct Fetchjob *job)
 {
-	Insertlist *pi;
+	Sumstream	*s;
+	time_t		mtime = 0;
+	int			code;
+	char		buf[BUFSIZ];
+
+	if ((code = fetch_gen(job)) != 0) {
+		job->unreachable = fetch_unreachable(code);
+		return NULL;
+	}
+
+	if (*job->to == '\0')
+		return NULL;
 
-	while (!SLIST_EMPTY(&inserthead)) {
-		pi = SLIST_FIRST(&inserthead);
-		SLIST_REMOVE_HEAD(&inserthead, next);
-		XFREE(pi->field);
-		XFREE(pi->value);
-		XFREE(pi);
+	/* same generation, nothing to fetch */
+	if (strcmp(job->to, job->gen) == 0) {
+		job->sum_mtime = -1;
+		return NULL;
 	}
+
+	snprintf(buf, BUFSIZ, "%s/%s.delta-%s-%s", job->repo, PKG_SUMMARY,
+		job->gen, job->to);
+
+	if ((s = sum_open(buf, &mtime, &code)) != NULL)
+		job->patch = 1;
+
+	return s;
 }
 
 /**
- * sqlite callback, fill cols.name[] with available columns names
+ * \fn fetch_catalog
+ *
+ * \brief fetch the repository's prebuilt catalog, see export_catalog()
  */
-int
-colnames(void *unused, int argc, char **argv, char **colname)
+static Sumstream *
+fetch_catalog(struct Fetchjob *job)
 {
-	int			i = 0;
+	Sumstream	*s;
+	int			code;
+	char		buf[BUFSIZ];
 
-	colcount++;
+	snprintf(buf, BUFSIZ, "%s/%s", job->repo, PKG_CATALOG);
 
-	cols.num = colcount;
-	XREALLOC(cols.name, colcount * sizeof(char *));
+	if ((s = sum_open(buf, &job->sum_mtime, &code)) == NULL) {
+		job->unreachable = fetch_unreachable(code);
+		return NULL;
+	}
+	job->catalog = 1;
 
-	for (i = 0; i < argc; i++)
-		if (argv[i] != NULL && strncmp(colname[i], "name", 4) == 0)
-			XSTRDUP(cols.name[colcount - 1], argv[i]);
+	/* the catalog is only used if it matches the repository's summary */
+	(void)fetch_gen(job);
 
-	return PDB_OK;
+	return s;
 }
 
 /**
- * for now, values are located on a SLIST, build INSERT line with them
+ * remote summary fetch, the returned stream is read by insert_summary()
+ *
+ * job->sum_mtime holds the database's summary mtime, 0 to force the
+ * reload. job->sumext, if not empty, is tried first and records the
+ * extension found. Once a repository is known, an up-to-date check is
+ * then a single conditional request, or a generation check when the
+ * repository publishes deltas. Its host is first checked to take
+ * connections, and an unreachable repository is not tried again for
+ * every extension, each attempt would wait for fetchTimeout. No
+ * database access here, this runs from the fetch
+ * workers.
  */
-static void
-prepare_insert(int pkgid, struct Summary sum, char *cur_repo)
+static Sumstream *
+fetch_summary(struct Fetchjob *job)
 {
-	char		*commit_query;
-	Insertlist	*pi;
+	Sumstream	*summary = NULL;
+	time_t		db_mtime = job->sum_mtime;
+	const char	*ext;
+	int			i, code;
+	char		buf[BUFSIZ];
+
+	/* a host which doesn't take connections isn't waited for */
+	if (!job->probed) {
+		job->probed = 1;
+		if (!fetch_reachable(job->repo)) {
+			job->unreachable = 1;
+			return NULL;
+		}
+	}
+
+	if (*job->gen != '\0') {
+		if ((summary = fetch_delta(job)) != NULL)
+			return summary;
+		if (job->sum_mtime < 0 || job->unreachable)
+			return NULL;
+		/*
+		 * another generation: it changed, whatever the mtime of what
+		 * it was loaded from, which may be its catalog
+		 */
+		if (*job->to != '\0')
+			db_mtime = job->sum_mtime = 0;
+	}
 
-	if (sum.type == REMOTE_SUMMARY)
-		query_size = (query_size + strlen(cur_repo)) * sizeof(char);
+	/*
+	 * a repository not known for its summary may publish a catalog,
+	 * the ones which do are then checked by their catalog
+	 */
+	if (*job->sumext == '\0' && !job->no_catalog) {
+		if ((summary = fetch_catalog(job)) != NULL)
+			return summary;
+		if (job->sum_mtime < 0 || job->unreachable)
+			return NULL;
+	}
 
-	XMALLOC(commit_query, query_size);
+	/* -1 is the last known extension, then try all extensions */
+	for (i = -1; i < 0 || sumexts[i] != NULL; i++) {
+		if (i < 0 && *job->sumext == '\0')
+			continue;
+		if (i >= 0 && strcmp(sumexts[i], job->sumext) == 0)
+			continue; /* already tried */
+		ext = i < 0 ? job->sumext : sumexts[i];
 
-	snprintf(commit_query, BUFSIZ, "INSERT INTO %s ( PKG_ID,", sum.tbl_name);
+		job->sum_mtime = db_mtime;
 
-	/* insert fields */
-	SLIST_FOREACH(pi, &inserthead, next)
-		XSNPRINTF(commit_query, query_size,
-			"%s\"%s\",", commit_query, pi->field);
+		snprintf(buf, BUFSIZ, "%s/%s.%s", job->repo, PKG_SUMMARY, ext);
 
-	/* insert REPOSITORY field */
-	if (sum.type == REMOTE_SUMMARY)
-		XSNPRINTF(commit_query, query_size, "%s\"REPOSITORY\")", commit_query);
-	else
-		commit_query[strlen(commit_query) - 1] = ')';
+		if ((summary = sum_open(buf, &job->sum_mtime, &code)) != NULL) {
+			/* pkg_summary found and not up-to-date */
+			if (ext != job->sumext)
+				strlcpy(job->sumext, ext, SMLLEN);
+			break;
+		}
 
-	XSNPRINTF(commit_query, query_size, "%s VALUES ( %d, ",
-		commit_query, pkgid);
+		if (job->sum_mtime < 0) /* pkg_summary found, but up-to-date */
+			return NULL;
 
-	/* insert values */
-	SLIST_FOREACH(pi, &inserthead, next)
-		XSNPRINTF(commit_query, query_size,
-			"%s\"%s\",", commit_query, pi->value);
+		/* update_remotedb() warns */
+		if (fetch_unreachable(code)) {
+			job->unreachable = 1;
+			return NULL;
+		}
+	}
 
-	/* insert repository URL if it's a remote pkg_summary */
-	if (sum.type == REMOTE_SUMMARY) {
-		XSNPRINTF(commit_query, query_size, "%s\"%s\");",
-			commit_query, cur_repo);
-	} else {
-		commit_query[strlen(commit_query) - 1] = ')';
-		strcat(commit_query, ";");
+	if (summary == NULL) {
+		fprintf(stderr, MSG_COULDNT_FETCH, buf);
+		return NULL;
 	}
 
-	/* append query to commit list */
-	commit_idx++;
-	XREALLOC(commit_list, (commit_idx + 1) * sizeof(char *));
-	commit_list[commit_idx] = commit_query;
+	/*
+	 * a repository only gets its generation checked first once it has
+	 * announced one, see import_summary(). Worth a request when the
+	 * whole summary is transferred anyway.
+	 */
+	if (*job->gen == '\0')
+		(void)fetch_gen(job);
+
+	return summary;
 }
 
+/* percentage on screen, see progress() */
+static int	shown;
+
 /**
- * add item to the main SLIST
+ * progress percentage, printed when it changes, -1 if unknown
  */
 static void
-add_to_slist(const char *field, const char *value)
+progress(int percent)
 {
-	Insertlist		*insert;
-
-	XMALLOC(insert, sizeof(Insertlist));
-	XSTRDUP(insert->field, field);
-	XSTRDUP(insert->value, value);
+	if (percent < 0 || percent == shown)
+		return;
 
-	SLIST_INSERT_HEAD(&inserthead, insert, next);
+	shown = percent;
+	printf(MSG_UPDATING_DB_PCT, percent);
+	fflush(stdout);
 }
 
-/**
- * fill-in secondary tables
- */
 static void
-child_table(const char *fmt, ...)
+freecols(struct Columns *cols)
 {
-	char	buf[BUFSIZ];
-	va_list	ap;
+	int i;
 
-	va_start(ap, fmt);
-	vsnprintf(buf, BUFSIZ, fmt, ap);
-	va_end(ap);
+	for (i = 0; i < cols->num; i++)
+		XFREE(cols->name[i]);
 
-	/* append query to commit_list */
-	commit_idx++;
-	XREALLOC(commit_list, (commit_idx + 1) * sizeof(char *));
-	XSTRDUP(commit_list[commit_idx], buf);
+	XFREE(cols->name);
+	cols->num = 0;
 }
 
-static void
-update_col(struct Summary sum, int pkgid, char *line)
+/**
+ * sqlite callback, fill cols->name[] with available columns names
+ */
+int
+colnames(void *param, int argc, char **argv, char **colname)
 {
-	static uint8_t	said = 0;
-	int				i;
-	char			*val, *p, buf[BUFSIZ];
-
-	/* check MACHINE_ARCH */
-	if (!said && (val = field_record("MACHINE_ARCH", line)) != NULL) {
-		if (strncmp(CHECK_MACHINE_ARCH, val, strlen(CHECK_MACHINE_ARCH))) {
-			printf(MSG_ARCH_DONT_MATCH, val, CHECK_MACHINE_ARCH);
-			if (!check_yesno(DEFAULT_NO))
-				exit(EXIT_FAILURE);
-			said = 1;
-			printf("\r"MSG_UPDATING_DB);
-		}
-	}
+	struct Columns	*cols = (struct Columns *)param;
+	int				i = 0;
 
-	/* DEPENDS */
-	if ((val = field_record("DEPENDS", line)) != NULL) {
-		if ((p = get_pkgname_from_depend(val)) != NULL) {
-			child_table(INSERT_DEPENDS_VALUES,	\
-				sum.deps, sum.deps, sum.deps,	\
-				pkgid, p, val);
-			XFREE(p);
-		} else
-			printf(MSG_COULD_NOT_GET_PKGNAME, val);
-	}
-	/* REQUIRES */
-	if ((val = field_record("REQUIRES", line)) != NULL)
-		child_table(INSERT_SINGLE_VALUE,		\
-			sum.requires, sum.requires, pkgid, val);
-	/* PROVIDES */
-	if ((val = field_record("PROVIDES", line)) != NULL)
-		child_table(INSERT_SINGLE_VALUE,		\
-			sum.provides, sum.provides, pkgid, val);
+	if (argv == NULL)
+		return PDB_ERR;
 
-	for (i = 0; i < cols.num; i++) {
-		snprintf(buf, BUFSIZ, "%s=", cols.name[i]);
+	cols->num++;
+	XREALLOC(cols->name, cols->num * sizeof(char *));
+	cols->name[cols->num - 1] = NULL;
 
-		val = field_record(cols.name[i], line);
+	for (i = 0; i < argc; i++)
+		if (argv[i] != NULL && strncmp(colname[i], "name", 4) == 0)
+			XSTRDUP(cols->name[cols->num - 1], argv[i]);
 
-		/* XXX: handle that later */
-		if (strncmp(cols.name[i], "DESCRIPTION", 11) == 0)
-			continue;
+	return PDB_OK;
+}
 
-		if (val != NULL && strncmp(buf, line, strlen(buf)) == 0) {
-			/* nasty little hack to prevent double quotes */
-			if (strchr(line, '"') != NULL)
-				for (p = line; *p != '\0'; p++)
-					if (*p == '"')
-						*p = '`';
+/* index of a column in cols, -1 if it does not exist */
+static int
+col_index(struct Columns *cols, const char *name)
+{
+	int i;
 
-			add_to_slist(cols.name[i], val);
+	for (i = 0; i < cols->num; i++)
+		if (cols->name[i] != NULL && strcmp(cols->name[i], name) == 0)
+			return i;
 
-			/* update query size */
-			query_size += strlen(cols.name[i]) + strlen(val) + 5;
-			/* 5 = strlen(\"\",) */
-		}
-	}
+	return -1;
 }
 
-#define NOVERSION "-0.0"
-
 static void
-insert_summary(struct Summary sum, char **summary, char *cur_repo)
+key_add(struct Loader *ld, const char *name, int type, int col)
 {
-	int			i;
-	static int	pkgid = 1;
-	char		*pkgname, *pkgvers, **psum, query[BUFSIZ], tmpname[BUFSIZ];
-	const char	*alnum = ALNUM;
-
-	if (summary == NULL) {
-		pkgindb_close();
-		errx(EXIT_FAILURE, "could not read summary");
+	struct Key	*k;
+	size_t		i, len = strlen(name), n = 0;
+
+	for (i = str_hash(name, len) & (KEYS_SIZE - 1);
+		(k = &ld->keys[i])->name != NULL; i = (i + 1) & (KEYS_SIZE - 1)) {
+		/* later definitions win */
+		if (k->len == len && memcmp(k->name, name, len) == 0)
+			break;
+		if (++n == KEYS_SIZE / 2)
+			errx(EXIT_FAILURE, "too many summary fields");
 	}
 
-	snprintf(query, BUFSIZ, "PRAGMA table_info(%s);", sum.tbl_name);
-
-	/* record columns names to cols */
-	pkgindb_doquery(query, colnames, NULL);
+	k->name = name;
+	k->len = len;
+	k->type = type;
+	k->col = col;
+}
 
-	SLIST_INIT(&inserthead);
+/**
+ * \fn key_lookup
+ *
+ * \brief find a field name of len bytes, NULL if the field is unknown
+ */
+static const struct Key *
+key_lookup(const struct Loader *ld, const char *name, size_t len)
+{
+	const struct Key	*k;
+	size_t				i;
 
-	XMALLOC(commit_list, sizeof(char *));
-	/* begin transaction */
-	XSTRDUP(commit_list[0], "BEGIN;");
+	for (i = str_hash(name, len) & (KEYS_SIZE - 1);
+		(k = &ld->keys[i])->name != NULL; i = (i + 1) & (KEYS_SIZE - 1))
+		if (k->len == len && memcmp(k->name, name, len) == 0)
+			return k;
 
-	printf(MSG_UPDATING_DB);
-	fflush(stdout);
+	return NULL;
+}
 
-	psum = summary;
-	/* main pkg_summary analysis loop */
-	while (*psum != NULL) {
-		/* CONFLICTS may appear before PKGNAME... */
-		if ((pkgname = field_record("CONFLICTS", *psum)) != NULL) {
-			snprintf(query, BUFSIZ,
-				"INSERT INTO %s (PKG_ID,%s_PKGNAME) VALUES (%d,\"%s\");",
-				sum.conflicts, sum.conflicts, pkgid, pkgname);
-
-			/* append query to commit_list */
-			commit_idx++;
-			XREALLOC(commit_list, (commit_idx + 1) * sizeof(char *));
-			XSTRDUP(commit_list[commit_idx], query);
-
-			psum++;
-			continue; /* there may be more */
-		}
+/* a main table column PROFILE_SLIM keeps */
+static int
+slim_col(const char *name)
+{
+	const char *const	*c;
 
-		/* PKGNAME record, should always be true  */
-		if ((pkgname = field_record("PKGNAME", *psum)) != NULL) {
+	for (c = slim_cols; *c != NULL; c++)
+		if (strcmp(*c, name) == 0)
+			return 1;
 
-			/* some rare packages have no version */
-			if (!exact_pkgfmt(pkgname)) {
-				snprintf(tmpname, BUFSIZ, "%s%s", pkgname, NOVERSION);
-				pkgname = tmpname;
-			}
+	return 0;
+}
 
-			add_to_slist("FULLPKGNAME", pkgname);
+/**
+ * \fn keys_prepare
+ *
+ * \brief map summary fields to main table columns and child tables.
+ * Columns filled by insert_pkg() itself are not summary fields, the
+ * ones PROFILE_SLIM doesn't keep are left unknown, hence NULL.
+ */
+static void
+keys_prepare(struct Loader *ld)
+{
+	int	i;
 
-			/* split PKGNAME and VERSION */
-			pkgvers = strrchr(pkgname, '-');
-			*pkgvers++ = '\0';
+	memset(ld->keys, 0, sizeof(ld->keys));
+
+	for (i = 0; i < ld->cols.num; i++)
+		if (ld->cols.name[i] != NULL && i != ld->pkgid_col &&
+			i != ld->fullpkgname_col && i != ld->pkgname_col &&
+			i != ld->pkgvers_col && i != ld->repository_col &&
+			i != ld->hash_col && i != ld->mtime_col &&
+			i != ld->inode_col && i != ld->info_mtime_col &&
+			(ld->profile == PROFILE_FULL ||
+			slim_col(ld->cols.name[i])))
+			key_add(ld, ld->cols.name[i], FIELD_COL, i);
+
+	key_add(ld, "PKGNAME", FIELD_PKGNAME, -1);
+	/* checked whatever the profile */
+	key_add(ld, "MACHINE_ARCH", FIELD_ARCH,
+		ld->profile == PROFILE_FULL ?
+		col_index(&ld->cols, "MACHINE_ARCH") : -1);
+	key_add(ld, "DEPENDS", FIELD_DEPS, -1);
+	key_add(ld, "CONFLICTS", FIELD_CONFLICTS, -1);
+	key_add(ld, "REQUIRES", FIELD_REQUIRES, -1);
+	key_add(ld, "PROVIDES", FIELD_PROVIDES, -1);
+	/* multi-line, only worth joining for the search index */
+	key_add(ld, "DESCRIPTION", ld->search != NULL &&
+		ld->profile == PROFILE_FULL ? FIELD_DESCR : FIELD_SKIP, -1);
+}
 
-			add_to_slist("PKGNAME", pkgname);
-			add_to_slist("PKGVERS", pkgvers);
+/**
+ * \fn loader_prepare
+ *
+ * \brief compile INSERT statements for sum's tables, if not done yet
+ */
+static struct Loader *
+loader_prepare(struct Summary sum)
+{
+	struct Loader	*ld = &loaders[sum.type];
+	char			query[BUFSIZ], cols[BUFSIZ], binds[BUFSIZ];
+	const char		**arr;
+	int				i;
 
-			/* nice little counter */
-			progress(pkgname[0]);
-		}
+	if (ld->pkg != NULL)
+		return ld;
 
-		psum++;
+	/* record columns names */
+	snprintf(query, BUFSIZ, "PRAGMA table_info(%s);", sum.tbl_name);
+	pkgindb_doquery(query, colnames, &ld->cols);
 
-		/* browse entries following PKGNAME and build the SQL query */
-		while (*psum != NULL && !chk_pkgname(*psum, *(psum - 1))) {
-			update_col(sum, pkgid, *psum);
-			psum++;
+	cols[0] = binds[0] = '\0';
+	for (i = 0; i < ld->cols.num; i++) {
+		if (i > 0) {
+			strlcat(cols, ",", BUFSIZ);
+			strlcat(binds, ",", BUFSIZ);
 		}
+		strlcat(cols, ld->cols.name[i], BUFSIZ);
+		strlcat(binds, "?", BUFSIZ);
+	}
 
-		/* build INSERT query */
-		prepare_insert(pkgid, sum, cur_repo);
-
-		/* next PKG_ID */
-		pkgid++;
+	ld->pkg = pkgindb_prepare("INSERT INTO %s (%s) VALUES (%s);",
+			sum.tbl_name, cols, binds);
+	ld->deps = pkgindb_prepare(INSERT_DEPENDS_VALUES,
+			sum.deps, sum.deps, sum.deps);
+	ld->conflicts = pkgindb_prepare(INSERT_SINGLE_VALUE,
+			sum.conflicts, sum.conflicts);
+	ld->requires = pkgindb_prepare(INSERT_SINGLE_VALUE,
+			sum.requires, sum.requires);
+	ld->provides = pkgindb_prepare(INSERT_SINGLE_VALUE,
+			sum.provides, sum.provides);
+
+	if (ld->pkg == NULL || ld->deps == NULL || ld->conflicts == NULL ||
+		ld->requires == NULL || ld->provides == NULL) {
+		pkgindb_close();
+		errx(EXIT_FAILURE, "could not prepare %s import", sum.tbl_name);
+	}
 
-		/* free the SLIST containing this package's key/vals */
-		free_insertlist();
+	ld->pkgid_col = col_index(&ld->cols, "PKG_ID");
+	ld->fullpkgname_col = col_index(&ld->cols, "FULLPKGNAME");
+	ld->pkgname_col = col_index(&ld->cols, "PKGNAME");
+	ld->pkgvers_col = col_index(&ld->cols, "PKGVERS");
+	ld->comment_col = col_index(&ld->cols, "COMMENT");
+	ld->repository_col = col_index(&ld->cols, "REPOSITORY");
+	ld->hash_col = col_index(&ld->cols, "PKG_HASH");
+	ld->mtime_col = col_index(&ld->cols, "PKG_MTIME");
+	ld->inode_col = col_index(&ld->cols, "PKG_INODE");
+	ld->info_mtime_col = col_index(&ld->cols, "PKG_INFO_MTIME");
 
-		/* reset max query size */
-		query_size = BUFSIZ;
+	if (sum.type == REMOTE_SUMMARY) {
+		/* both NULL when the search index is missing */
+		ld->search = pkgindb_prepare(INSERT_REMOTE_SEARCH);
+		ld->unindex = pkgindb_prepare(DELETE_SEARCH_ID);
+		if (ld->search == NULL || ld->unindex == NULL) {
+			pkgindb_finalize(&ld->search);
+			pkgindb_finalize(&ld->unindex);
+		}
+	}
 
-	} /* while *psum != NULL */
+	keys_prepare(ld);
 
-	commit_idx++;
-	XREALLOC(commit_list, (commit_idx + 2) * sizeof(char *));
-	XSTRDUP(commit_list[commit_idx], "COMMIT;");
-	commit_list[commit_idx + 1] = NULL;
+	/* children first, main table last */
+	for (i = 0, arr = &(sum.tbl_name) + 1; *arr != NULL; ++arr)
+		ld->del[i++] = pkgindb_prepare(DELETE_PKG_ID, *arr);
+	ld->del[i] = pkgindb_prepare(DELETE_PKG_ID, sum.tbl_name);
 
-	/* do the insert */
-	for (i = 0; commit_list[i] != NULL; i++)
-		pkgindb_doquery(commit_list[i], NULL, NULL);
+	if (ld->del[i] == NULL) {
+		pkgindb_close();
+		errx(EXIT_FAILURE, "could not prepare %s import", sum.tbl_name);
+	}
 
-	progress(alnum[strlen(alnum) - 1]); /* XXX: nasty. */
+	if (sum.type != REMOTE_SUMMARY)
+		return ld;
 
-	free_list(commit_list);
-	commit_idx = 0;
+	/* REMOTE_SEEN is created by import_summary() */
+	ld->lookup = pkgindb_prepare(REMOTE_PKG_HASH);
+	ld->seen = pkgindb_prepare(INSERT_REMOTE_SEEN);
 
-	/* reset pkgid */
-	if (sum.type == LOCAL_SUMMARY)
-		pkgid = 1;
+	if (ld->lookup == NULL || ld->seen == NULL) {
+		pkgindb_close();
+		errx(EXIT_FAILURE, "could not prepare %s import", sum.tbl_name);
+	}
 
-	printf("\n");
+	return ld;
 }
 
 static void
-delete_remote_tbl(struct Summary sum, char *repo)
+loader_finalize(void)
 {
-	char		buf[BUFSIZ];
-	const char	**arr;
+	struct Loader	*ld;
+	int				i;
 
-	/*
-	 * delete repository related tables
-	 * loop through sumsw structure to record table name
-	 * and call associated SQL query
-	 */
-	/* (REMOTE[LOCAL)_PKG is first -> skip */
-	for (arr = &(sum.tbl_name) + 1; *arr != NULL; ++arr) {
-		snprintf(buf, BUFSIZ, DELETE_REMOTE,
-			*arr, *arr, *arr, *arr, *arr, repo, *arr);
-		pkgindb_doquery(buf, NULL, NULL);
+	for (ld = loaders; ld < loaders + 2; ld++) {
+		pkgindb_finalize(&ld->pkg);
+		pkgindb_finalize(&ld->deps);
+		pkgindb_finalize(&ld->conflicts);
+		pkgindb_finalize(&ld->requires);
+		pkgindb_finalize(&ld->provides);
+		pkgindb_finalize(&ld->search);
+		pkgindb_finalize(&ld->unindex);
+		pkgindb_finalize(&ld->lookup);
+		pkgindb_finalize(&ld->seen);
+		for (i = 0; i < 5; i++)
+			pkgindb_finalize(&ld->del[i]);
+		freecols(&ld->cols);
 	}
 
-	snprintf(buf, BUFSIZ,
-		"DELETE FROM REMOTE_PKG WHERE REPOSITORY = '%s';", repo);
-	pkgindb_doquery(buf, NULL, NULL);
+	parse_finalize();
 }
 
+/**
+ * bind a package's values to the main table statement
+ */
 static int
-pdb_clean_remote(void *param, int argc, char **argv, char **colname)
+insert_pkg(int pkgid, struct Loader *ld, struct Pkgrec *pr, char *cur_repo)
 {
-	int	i;
-	size_t	repolen;
-	char	**repos = pkg_repos, query[BUFSIZ];
-
-	if (argv == NULL)
-		return PDB_ERR;
-
-	for (i = 0; repos[i] != NULL; i++) {
-		repolen = strlen(repos[i]);
-		if (repolen == strlen(argv[0]) &&
-			strncmp(repos[i], argv[0], repolen) == 0 && !force_update)
-		   	return PDB_OK;
-	}
-	/* did not find argv[0] (db repository) in pkg_repos */
-	printf(MSG_CLEANING_DB_FROM_REPO, argv[0]);
+	struct Field	*f;
+
+	/* statement placeholders are numbered from 1 */
+	sqlite3_bind_int(ld->pkg, ld->pkgid_col + 1, pkgid);
+
+	/* bound backwards so the first occurrence of a column wins */
+	for (f = pr->fields + pr->nfields - 1; f >= pr->fields; f--)
+		if (f->type == FIELD_COL)
+			sqlite3_bind_text(ld->pkg, f->col + 1, f->val, -1,
+				SQLITE_STATIC);
+
+	if (ld->fullpkgname_col >= 0)
+		sqlite3_bind_text(ld->pkg, ld->fullpkgname_col + 1,
+			pr->fullpkgname, -1, SQLITE_STATIC);
+	if (ld->pkgname_col >= 0)
+		sqlite3_bind_text(ld->pkg, ld->pkgname_col + 1,
+			pr->pkgname, -1, SQLITE_STATIC);
+	if (ld->pkgvers_col >= 0)
+		sqlite3_bind_text(ld->pkg, ld->pkgvers_col + 1,
+			pr->pkgvers, -1, SQLITE_STATIC);
 
-	delete_remote_tbl(sumsw[REMOTE_SUMMARY], argv[0]);
+	/* insert repository URL if it's a remote pkg_summary */
+	if (cur_repo != NULL && ld->repository_col >= 0)
+		sqlite3_bind_text(ld->pkg, ld->repository_col + 1, cur_repo, -1,
+			SQLITE_STATIC);
 
-	snprintf(query, BUFSIZ,
-		"DELETE FROM REPOS WHERE REPO_URL = \'%s\';", argv[0]);
-	pkgindb_doquery(query, NULL, NULL);
+	if (ld->hash_col >= 0)
+		sqlite3_bind_int64(ld->pkg, ld->hash_col + 1,
+			(sqlite3_int64)pr->hash);
 
-	/* force pkg_summary reload for available repository */
-	force_fetch = 1;
+	if (pr->pkgdir != NULL && ld->mtime_col >= 0 && ld->inode_col >= 0) {
+		sqlite3_bind_int64(ld->pkg, ld->mtime_col + 1, pr->pkgdir->mtime);
+		sqlite3_bind_int64(ld->pkg, ld->inode_col + 1, pr->pkgdir->inode);
+	}
+	if (pr->pkgdir != NULL && ld->info_mtime_col >= 0)
+		sqlite3_bind_int64(ld->pkg, ld->info_mtime_col + 1,
+			pr->pkgdir->info_mtime);
 
-	return PDB_OK;
+	return pkgindb_step(ld->pkg);
 }
 
+/**
+ * fill-in secondary tables
+ */
+static void
+child_table(sqlite3_stmt *stmt, int pkgid, const char *val, const char *dewey)
+{
+	sqlite3_bind_int(stmt, 1, pkgid);
+	sqlite3_bind_text(stmt, 2, val, -1, SQLITE_STATIC);
+	if (dewey != NULL)
+		sqlite3_bind_text(stmt, 3, dewey, -1, SQLITE_STATIC);
+
+	pkgindb_step(stmt);
+}
+
+#define NOVERSION "-0.0"
+
+/* make room for len bytes, only while nothing points to the arena */
+static void
+arena_reserve(struct Arena *a, size_t len)
+{
+	a->len = 0;
+	if (len > a->size) {
+		a->size = len;
+		XREALLOC(a->buf, a->size);
+	}
+}
+
+static char *
+arena_alloc(struct Arena *a, size_t len)
+{
+	char	*p;
+
+	if (a->len + len > a->size)
+		errx(EXIT_FAILURE, "summary arena exhausted");
+
+	p = a->buf + a->len;
+	a->len += len;
+
+	return p;
+}
+
+/* pr->fields is the tail of the batch fields, sized by parse_batch() */
+static void
+field_add(struct Pkgrec *pr, int type, int col, char *val, char *dewey)
+{
+	struct Field	*f;
+
+	f = &pr->fields[pr->nfields++];
+	f->type = type;
+	f->col = col;
+	f->val = val;
+	f->dewey = dewey;
+}
+
+/**
+ * \fn parse_record
+ *
+ * \brief split a raw record to pr, buf is modified in place and must
+ * outlive pr. Fields and derived strings are carved from the batch,
+ * there is no heap allocation per record. Runs on the parser threads,
+ * no database access here.
+ */
+static void
+parse_record(struct Loader *ld, struct Batch *b, char *buf, size_t len,
+	struct Pkgrec *pr, struct Field *fields)
+{
+	const struct Key	*k;
+	const char			*eq;
+	char				*line, *eol, *val, *dend = NULL, *dnext = NULL;
+	size_t				namelen;
+
+	memset(pr, 0, sizeof(struct Pkgrec));
+	pr->fields = fields;
+	pr->hash = str_hash(buf, len);
+
+	for (line = buf; line < buf + len; line = eol + 1) {
+		/* records lines all end with a newline */
+		eol = __UNCONST(scan_line(line, buf + len, &eq));
+		*eol = '\0';
+
+		/* unknown fields are skipped */
+		if (eq == NULL || (k = key_lookup(ld, line, eq - line)) == NULL)
+			continue;
+		val = __UNCONST(eq + 1);
+
+		switch (k->type) {
+		case FIELD_PKGNAME:
+			if (pr->fullpkgname != NULL)
+				break;
+
+			/* room for both FULLPKGNAME and PKGNAME */
+			namelen = strlen(val) + sizeof(NOVERSION);
+			pr->fullpkgname = arena_alloc(&b->arena, namelen * 2);
+
+			/* some rare packages have no version */
+			snprintf(pr->fullpkgname, namelen, "%s%s", val,
+				exact_pkgfmt(val) ? "" : NOVERSION);
+
+			/* split PKGNAME and VERSION */
+			pr->pkgname = pr->fullpkgname + namelen;
+			strlcpy(pr->pkgname, pr->fullpkgname, namelen);
+			pr->pkgvers = strrchr(pr->pkgname, '-');
+			*pr->pkgvers++ = '\0';
+			break;
+		case FIELD_DEPS:
+			/* a NULL pkgname is reported by write_record() */
+			field_add(pr, FIELD_DEPS, -1, depend_to_pkgname(val,
+				arena_alloc(&b->arena, strlen(val) + 1)), val);
+			break;
+		case FIELD_ARCH:
+			pr->machine_arch = val;
+			if (k->col >= 0)
+				field_add(pr, FIELD_COL, k->col, val, NULL);
+			break;
+		case FIELD_DESCR:
+			/* join consecutive DESCRIPTION lines in place */
+			if (pr->descr == NULL) {
+				pr->descr = val;
+				dend = eol;
+			} else if (line == dnext) {
+				*dend++ = '\n';
+				memmove(dend, val, eol - val + 1);
+				dend += eol - val;
+			} else /* interrupted by another field, not joined */
+				break;
+			dnext = eol + 1;
+			break;
+		case FIELD_SKIP:
+			break;
+		default:
+			if (k->col == ld->comment_col && pr->pkgcomment == NULL)
+				pr->pkgcomment = val;
+			field_add(pr, k->type, k->col, val, NULL);
+		}
+	}
+}
+
+/**
+ * delete every row belonging to pkgid
+ */
+static void
+delete_pkgid(struct Loader *ld, int pkgid)
+{
+	int	i;
+
+	for (i = 0; i < 5; i++) {
+		sqlite3_bind_int(ld->del[i], 1, pkgid);
+		pkgindb_step(ld->del[i]);
+	}
+
+	if (ld->unindex != NULL) {
+		sqlite3_bind_int(ld->unindex, 1, pkgid);
+		pkgindb_step(ld->unindex);
+	}
+}
+
+/**
+ * \fn lookup_pkg
+ *
+ * \brief PKG_ID of fullpkgname in cur_repo if its record has changed,
+ * 0 if it is unchanged, -1 if it is unknown
+ */
+static int
+lookup_pkg(struct Loader *ld, char *cur_repo, const char *fullpkgname,
+	uint64_t hash)
+{
+	int	pkgid = -1;
+
+	sqlite3_bind_text(ld->lookup, 1, fullpkgname, -1, SQLITE_STATIC);
+	sqlite3_bind_text(ld->lookup, 2, cur_repo, -1, SQLITE_STATIC);
+
+	if (sqlite3_step(ld->lookup) == SQLITE_ROW) {
+		pkgid = sqlite3_column_int(ld->lookup, 0);
+
+		if (sqlite3_column_type(ld->lookup, 1) != SQLITE_NULL &&
+			sqlite3_column_int64(ld->lookup, 1) == (sqlite3_int64)hash) {
+			/* unchanged, keep it */
+			sqlite3_bind_int(ld->seen, 1, pkgid);
+			pkgindb_step(ld->seen);
+
+			pkgid = 0;
+		}
+	}
+
+	sqlite3_reset(ld->lookup);
+	sqlite3_clear_bindings(ld->lookup);
+
+	return pkgid;
+}
+
+/**
+ * \fn write_record
+ *
+ * \brief insert a parsed record as *pkgid, the main row goes first so
+ * child rows never point to a package that failed to insert
+ */
+static void
+write_record(struct Loader *ld, struct Pkgrec *pr, int *pkgid,
+	char *cur_repo, struct Delta *delta)
+{
+	static uint8_t	said = 0;
+	struct Field	*f;
+	int				oldid = -1;
+
+	if (pr->fullpkgname == NULL)
+		return;
+
+	/* check MACHINE_ARCH */
+	if (!said && pr->machine_arch != NULL &&
+		strncmp(CHECK_MACHINE_ARCH, pr->machine_arch,
+			strlen(CHECK_MACHINE_ARCH))) {
+		printf(MSG_ARCH_DONT_MATCH, pr->machine_arch, CHECK_MACHINE_ARCH);
+		if (!check_yesno(DEFAULT_NO))
+			exit(EXIT_FAILURE);
+		said = 1;
+		printf("\r"MSG_UPDATING_DB);
+		shown = 0;
+	}
+
+	if (delta->on) {
+		oldid = lookup_pkg(ld, cur_repo, pr->fullpkgname, pr->hash);
+		if (oldid == 0)
+			return;
+		if (oldid > 0) {
+			delete_pkgid(ld, oldid);
+			delta->changed++;
+		} else
+			delta->added++;
+	}
+
+	/* run INSERT with this package's values */
+	if (insert_pkg(*pkgid, ld, pr, cur_repo) != PDB_OK)
+		return;
+
+	/* PROFILE_SLIM skips DESCRIPTION, names and comments are indexed */
+	if (ld->search != NULL) {
+		sqlite3_bind_int(ld->search, 1, *pkgid);
+		sqlite3_bind_text(ld->search, 2, pr->pkgname, -1, SQLITE_STATIC);
+		sqlite3_bind_text(ld->search, 3, pr->pkgcomment, -1,
+			SQLITE_STATIC);
+		sqlite3_bind_text(ld->search, 4, pr->descr, -1, SQLITE_STATIC);
+		pkgindb_step(ld->search);
+	}
+
+	for (f = pr->fields; f < pr->fields + pr->nfields; f++) {
+		switch (f->type) {
+		case FIELD_DEPS:
+			if (f->val != NULL)
+				child_table(ld->deps, *pkgid, f->val, f->dewey);
+			else
+				printf(MSG_COULD_NOT_GET_PKGNAME, f->dewey);
+			break;
+		case FIELD_CONFLICTS:
+			child_table(ld->conflicts, *pkgid, f->val, NULL);
+			break;
+		case FIELD_REQUIRES:
+			child_table(ld->requires, *pkgid, f->val, NULL);
+			break;
+		case FIELD_PROVIDES:
+			child_table(ld->provides, *pkgid, f->val, NULL);
+			break;
+		}
+	}
+
+	if (delta->on) {
+		sqlite3_bind_int(ld->seen, 1, *pkgid);
+		pkgindb_step(ld->seen);
+	}
+
+	/* next PKG_ID */
+	(*pkgid)++;
+}
+
+/**
+ * append len bytes of val as a line of the batch's current record,
+ * prefixed with var= if var is set
+ */
+static void
+record_addn(struct Batch *b, const char *var, const char *val, size_t len)
+{
+	size_t	varlen = var != NULL ? strlen(var) : 0;
+	size_t	need = b->len + varlen + 1 + len + 1;
+
+	if (need > b->size) {
+		while (need > b->size)
+			b->size = b->size > 0 ? b->size * 2 : SUM_BATCH_SIZE;
+		XREALLOC(b->buf, b->size);
+	}
+
+	if (var != NULL) {
+		memcpy(b->buf + b->len, var, varlen);
+		b->len += varlen;
+		b->buf[b->len++] = '=';
+	}
+	memcpy(b->buf + b->len, val, len);
+	b->len += len;
+	b->buf[b->len++] = '\n';
+	b->nlines++;
+}
+
+static void
+record_add(struct Batch *b, const char *line)
+{
+	record_addn(b, NULL, line, strlen(line));
+}
+
+/* PKG_DBDIR, resolved by the main thread, see list_pkgdb() */
+static const char	*pkgdb_dir;
+
+/* +BUILD_INFO variables which are part of a summary, as in pkg_info -X */
+static const char *const bi_vars[] = {
+	"PKGPATH", "CATEGORIES", "PROVIDES", "REQUIRES", "PKG_OPTIONS",
+	"OPSYS", "OS_VERSION", "MACHINE_ARCH", "LICENSE", "HOMEPAGE",
+	"PKGTOOLS_VERSION", "BUILD_DATE", "PREV_PKGPATH", "SUPERSEDES", NULL
+};
+
+/* +CONTENTS commands which are part of a summary */
+static const struct Plistvar {
+	const char	*cmd;
+	const char	*var;
+} plist_vars[] = {
+	{ "@name ", "PKGNAME" },
+	{ "@pkgdep ", "DEPENDS" },
+	{ "@pkgcfl ", "CONFLICTS" },
+	{ NULL, NULL }
+};
+
+/**
+ * \fn read_meta
+ *
+ * \brief read pkg's metadata file to b->meta, NUL terminated. Returns
+ * its length, -1 if it can't be read.
+ */
+static ssize_t
+read_meta(struct Batch *b, const char *pkg, const char *file)
+{
+	struct stat	st;
+	ssize_t		len, n = 0;
+	char		path[BUFSIZ];
+	int			fd;
+
+	snprintf(path, BUFSIZ, "%s/%s/%s", pkgdb_dir, pkg, file);
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	if ((size_t)st.st_size + 1 > b->metasize) {
+		b->metasize = st.st_size + 1;
+		XREALLOC(b->meta, b->metasize);
+	}
+
+	for (len = 0; len < st.st_size; len += n)
+		if ((n = read(fd, b->meta + len, st.st_size - len)) <= 0)
+			break;
+
+	close(fd);
+
+	if (n < 0)
+		return -1;
+
+	b->meta[len] = '\0';
+
+	return len;
+}
+
+/* next line of a metadata file, its length without trailing blanks */
+static char *
+meta_line(char **next, size_t *len)
+{
+	char	*line = *next, *eol;
+
+	if (*line == '\0')
+		return NULL;
+
+	eol = line + strcspn(line, "\n");
+	*next = *eol == '\n' ? eol + 1 : eol;
+
+	while (eol > line && isspace((unsigned char)eol[-1]))
+		eol--;
+	*len = eol - line;
+
+	return line;
+}
+
+/**
+ * \fn pkg_record
+ *
+ * \brief append an installed package's record to b, read from its
+ * PKG_DBDIR metadata as pkg_info -X would print it, plus its
+ * +INSTALLED_INFO automatic flag as PKG_AUTOMATIC. Entries without
+ * +CONTENTS are not packages and give an empty record.
+ */
+static void
+pkg_record(struct Batch *b, const char *pkg)
+{
+	const struct Plistvar	*pv;
+	const char *const		*bv;
+	char					*line, *next;
+	size_t					len, cmdlen;
+	uint8_t					named = 0, automatic = 0;
+
+	if (read_meta(b, pkg, CONTENTS_FNAME) < 0)
+		return;
+
+	for (next = b->meta; (line = meta_line(&next, &len)) != NULL;) {
+		if (*line != CMD_CHAR)
+			continue;
+
+		for (pv = plist_vars; pv->cmd != NULL; pv++) {
+			cmdlen = strlen(pv->cmd);
+			if (len > cmdlen && strncmp(line, pv->cmd, cmdlen) == 0) {
+				record_addn(b, pv->var, line + cmdlen, len - cmdlen);
+				named |= pv == plist_vars;
+				break;
+			}
+		}
+	}
+
+	/* no @name, the directory is named after the package */
+	if (!named)
+		record_addn(b, "PKGNAME", pkg, strlen(pkg));
+
+	if (read_meta(b, pkg, COMMENT_FNAME) >= 0)
+		for (next = b->meta; (line = meta_line(&next, &len)) != NULL;)
+			record_addn(b, "COMMENT", line, len);
+
+	if (read_meta(b, pkg, SIZE_PKG_FNAME) >= 0) {
+		next = b->meta;
+		if ((line = meta_line(&next, &len)) != NULL)
+			record_addn(b, "SIZE_PKG", line, len);
+	}
+
+	if (read_meta(b, pkg, BUILD_INFO_FNAME) >= 0)
+		for (next = b->meta; (line = meta_line(&next, &len)) != NULL;)
+			for (bv = bi_vars; *bv != NULL; bv++) {
+				cmdlen = strlen(*bv);
+				if (len > cmdlen && line[cmdlen] == '=' &&
+					strncmp(line, *bv, cmdlen) == 0) {
+					record_addn(b, NULL, line, len);
+					break;
+				}
+			}
+
+	/* as is_automatic_installed() would tell, a repeated variable is no */
+	cmdlen = strlen(AUTOMATIC_VARNAME);
+	if (read_meta(b, pkg, INSTALLED_INFO_FNAME) >= 0)
+		for (next = b->meta; (line = meta_line(&next, &len)) != NULL;)
+			if (len > cmdlen && line[cmdlen] == '=' &&
+				strncmp(line, AUTOMATIC_VARNAME, cmdlen) == 0) {
+				line += cmdlen + 1;
+				len -= cmdlen + 1;
+				if (len > 0 && *line == ' ') {
+					line++;
+					len--;
+				}
+				automatic = automatic == 0 && len == 3 &&
+					strncasecmp(line, "yes", 3) == 0 ? 1 : 2;
+			}
+
+	record_add(b, automatic == 1 ? "PKG_AUTOMATIC=1" : "PKG_AUTOMATIC=0");
+}
+
+static int
+pkgdircmp(const void *a, const void *b)
+{
+	return strcmp(((const struct Pkgdir *)a)->name,
+		((const struct Pkgdir *)b)->name);
+}
+
+/**
+ * \fn list_pkgdb
+ *
+ * \brief installed packages and their snapshots, sorted by name. Entries
+ * without +CONTENTS are not packages.
+ */
+static int
+list_pkgdb(struct Pkgdir **pkgs)
+{
+	DIR				*dp;
+	struct dirent	*ep;
+	struct stat		st;
+	char			path[BUFSIZ];
+	int				count = 0;
+
+	pkgdb_dir = _pkgdb_getPKGDB_DIR();
+
+	if ((dp = opendir(pkgdb_dir)) == NULL)
+		err(EXIT_FAILURE, "couldn't open %s", pkgdb_dir);
+
+	XMALLOC(*pkgs, sizeof(struct Pkgdir));
+
+	while ((ep = readdir(dp)) != NULL) {
+		if (ep->d_name[0] == '.')
+			continue;
+
+		snprintf(path, BUFSIZ, "%s/%s/" CONTENTS_FNAME, pkgdb_dir,
+			ep->d_name);
+		if (stat(path, &st) < 0)
+			continue;
+
+		XREALLOC(*pkgs, (count + 2) * sizeof(struct Pkgdir));
+		XSTRDUP((*pkgs)[count].name, ep->d_name);
+		(*pkgs)[count].mtime = (int64_t)st.st_mtime;
+		(*pkgs)[count].inode = (int64_t)st.st_ino;
+
+		snprintf(path, BUFSIZ, "%s/%s/" INSTALLED_INFO_FNAME, pkgdb_dir,
+			ep->d_name);
+		(*pkgs)[count].info_mtime =
+			stat(path, &st) < 0 ? 0 : (int64_t)st.st_mtime;
+		count++;
+	}
+	closedir(dp);
+
+	(*pkgs)[count].name = NULL;
+	qsort(*pkgs, count, sizeof(struct Pkgdir), pkgdircmp);
+
+	return count;
+}
+
+static void
+free_pkgdirs(struct Pkgdir *pkgs)
+{
+	struct Pkgdir	*pd;
+
+	for (pd = pkgs; pd->name != NULL; pd++)
+		XFREE(pd->name);
+	XFREE(pkgs);
+}
+
+static void
+parse_batch(struct Batch *b)
+{
+	struct Field	*f;
+	int				i;
+
+	/* installed packages are read here, off the main thread */
+	for (i = 0; i < b->npkgs; i++) {
+		pkg_record(b, b->pkgs[i].name);
+		b->off[++b->nrec] = b->len;
+	}
+
+	/* at most one field per line */
+	if (b->nlines > b->fieldsize) {
+		b->fieldsize = b->nlines;
+		XREALLOC(b->fields, b->fieldsize * sizeof(struct Field));
+	}
+	/*
+	 * derived strings are no longer than their value plus a NUL, except
+	 * both package names which may add a NOVERSION each
+	 */
+	arena_reserve(&b->arena,
+		2 * b->len + b->nrec * 2 * sizeof(NOVERSION));
+
+	for (i = 0, f = b->fields; i < b->nrec; f += b->recs[i++].nfields) {
+		parse_record(parsers.ld, b, b->buf + b->off[i],
+			b->off[i + 1] - b->off[i], &b->recs[i], f);
+		if (b->npkgs > 0)
+			b->recs[i].pkgdir = &b->pkgs[i];
+	}
+}
+
+/**
+ * \fn parse_worker
+ *
+ * \brief parse queued batches, in queue order, until parse_stop()
+ */
+static void *
+parse_worker(void *arg)
+{
+	struct Batch	*b;
+
+	pthread_mutex_lock(&parsers.lock);
+	for (;;) {
+		b = &parsers.batches[parsers.next];
+
+		if (b->state != BATCH_QUEUED) {
+			if (parsers.quit)
+				break;
+			pthread_cond_wait(&parsers.cond, &parsers.lock);
+			continue;
+		}
+
+		b->state = BATCH_PARSING;
+		parsers.next = (parsers.next + 1) % PARSE_BATCHES;
+		pthread_mutex_unlock(&parsers.lock);
+
+		parse_batch(b);
+
+		pthread_mutex_lock(&parsers.lock);
+		b->state = BATCH_PARSED;
+		pthread_cond_broadcast(&parsers.cond);
+	}
+	pthread_mutex_unlock(&parsers.lock);
+
+	return NULL;
+}
+
+/**
+ * \fn parse_start
+ *
+ * \brief start the parser threads, one per spare CPU. With a single CPU,
+ * batches are parsed by the main thread.
+ */
+static void
+parse_start(struct Loader *ld)
+{
+	struct Batch	*b;
+	long			ncpu;
+	int				i, nworkers;
+
+	parsers.ld = ld;
+	parsers.next = 0;
+	parsers.quit = 0;
+
+	scan_init();
+
+	for (b = parsers.batches; b < parsers.batches + PARSE_BATCHES; b++) {
+		if (b->off == NULL) {
+			XMALLOC(b->off, (RECORDS_PER_BATCH + 1) * sizeof(size_t));
+			XMALLOC(b->recs, RECORDS_PER_BATCH * sizeof(struct Pkgrec));
+		}
+		b->len = 0;
+		b->nrec = 0;
+		b->nlines = 0;
+		b->npkgs = 0;
+		b->state = BATCH_FREE;
+	}
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	/* the main thread is busy reading and writing */
+	nworkers = ncpu > 1 ? ncpu - 1 : 0;
+	if (nworkers > MAX_PARSE_WORKERS)
+		nworkers = MAX_PARSE_WORKERS;
+
+	for (i = 0; i < nworkers; i++)
+		if (pthread_create(&parsers.workers[i], NULL, parse_worker,
+				NULL) != 0)
+			break;
+
+	parsers.nworkers = i;
+}
+
+static void
+parse_stop(void)
+{
+	int	i;
+
+	pthread_mutex_lock(&parsers.lock);
+	parsers.quit = 1;
+	pthread_cond_broadcast(&parsers.cond);
+	pthread_mutex_unlock(&parsers.lock);
+
+	for (i = 0; i < parsers.nworkers; i++)
+		pthread_join(parsers.workers[i], NULL);
+
+	parsers.nworkers = 0;
+}
+
+static void
+parse_finalize(void)
+{
+	struct Batch	*b;
+
+	for (b = parsers.batches; b < parsers.batches + PARSE_BATCHES; b++) {
+		XFREE(b->buf);
+		XFREE(b->off);
+		XFREE(b->recs);
+		XFREE(b->fields);
+		XFREE(b->arena.buf);
+		XFREE(b->meta);
+		b->size = 0;
+		b->fieldsize = 0;
+		b->arena.size = 0;
+		b->metasize = 0;
+	}
+}
+
+/* hand a full batch to the parsers */
+static void
+batch_submit(struct Batch *b)
+{
+	if (parsers.nworkers == 0) {
+		parse_batch(b);
+		b->state = BATCH_PARSED;
+		return;
+	}
+
+	pthread_mutex_lock(&parsers.lock);
+	b->state = BATCH_QUEUED;
+	pthread_cond_broadcast(&parsers.cond);
+	pthread_mutex_unlock(&parsers.lock);
+}
+
+/* wait for a batch to be parsed and write its records */
+static void
+batch_write(struct Batch *b, int *pkgid, char *cur_repo, struct Delta *delta)
+{
+	int	i;
+
+	pthread_mutex_lock(&parsers.lock);
+	while (b->state != BATCH_PARSED)
+		pthread_cond_wait(&parsers.cond, &parsers.lock);
+	pthread_mutex_unlock(&parsers.lock);
+
+	for (i = 0; i < b->nrec; i++)
+		write_record(parsers.ld, &b->recs[i], pkgid, cur_repo, delta);
+
+	stats.records += b->nrec;
+
+	b->len = 0;
+	b->nrec = 0;
+	b->nlines = 0;
+	b->pkgs = NULL;
+	b->npkgs = 0;
+
+	pthread_mutex_lock(&parsers.lock);
+	b->state = BATCH_FREE;
+	pthread_mutex_unlock(&parsers.lock);
+}
+
+/**
+ * \fn batch_push
+ *
+ * \brief hand the batch being filled to the parsers, writing the
+ * oldest one when the ring is full
+ */
+static void
+batch_push(int *head, int *tail, int *pkgid, char *cur_repo,
+	struct Delta *delta)
+{
+	batch_submit(&parsers.batches[*tail]);
+	*tail = (*tail + 1) % PARSE_BATCHES;
+
+	if (*tail == *head) {
+		batch_write(&parsers.batches[*head], pkgid, cur_repo, delta);
+		*head = (*head + 1) % PARSE_BATCHES;
+	}
+}
+
+/*
+ * a delta summary starts with its generations and the packages it
+ * removes, up to the first empty line, see mkdelta.c
+ */
+static void
+patch_removed(struct Loader *ld, Sumstream *summary, char *cur_repo,
+	struct Delta *delta)
+{
+	char	*line, fullpkgname[BUFSIZ];
+	int		pkgid;
+
+	while ((line = sum_getline(summary)) != NULL && *line != '\0') {
+		if (strncmp(line, "REMOVED=", 8) != 0)
+			continue;
+		line += 8;
+
+		/* as parse_record() names it */
+		snprintf(fullpkgname, BUFSIZ, "%s%s", line,
+			exact_pkgfmt(line) ? "" : NOVERSION);
+
+		/* a 0 hash never matches in practice: known packages' PKG_ID */
+		if ((pkgid = lookup_pkg(ld, cur_repo, fullpkgname, 0)) > 0) {
+			delete_pkgid(ld, pkgid);
+			delta->removed++;
+		}
+	}
+}
+
+/*
+ * stream summary lines to the database, records are separated by empty
+ * lines. Without a summary, the records of the installed packages pkgs
+ * are read from PKG_DBDIR instead. Callers are responsible for the
+ * enclosing transaction.
+ *
+ * Records are grouped in batches which are parsed by the parser threads
+ * and written here, in summary order, so all database accesses stay on
+ * the calling thread.
+ *
+ * With DELTA_ON, existing packages of cur_repo are matched by
+ * FULLPKGNAME and record hash: unchanged ones are left untouched, changed
+ * ones are replaced and the ones missing from the summary are removed.
+ * DELTA_PATCH reads a delta summary, which lists the removed packages.
+ *
+ * profile tells which fields are kept, PROFILE_SLIM packages only
+ * having their names and comments in the search index.
+ */
+static void
+insert_summary(struct Summary sum, Sumstream *summary, struct Pkgdir *pkgs,
+	char *cur_repo, uint8_t on, uint8_t profile)
+{
+	struct Loader	*ld;
+	struct Batch	*b;
+	struct Delta	delta = { on, 0, 0, 0 };
+	struct Pkgdir	*pd = pkgs;
+	int				pkgid, head = 0, tail = 0, npkgs = 0, changes;
+	char			*line, query[BUFSIZ], buf[BUFSIZ];
+	const char		**arr;
+	int				first = 0, last = 0;
+	double			start = time_sec();
+
+	if (summary == NULL && pkgs == NULL) {
+		pkgindb_close();
+		errx(EXIT_FAILURE, "could not read summary");
+	}
+
+	ld = loader_prepare(sum);
+
+	/* repositories may be loaded with different profiles */
+	if (ld->profile != profile) {
+		ld->profile = profile;
+		keys_prepare(ld);
+	}
+
+	/* PKG_ID are unique across repositories */
+	if (cur_repo != NULL) {
+		repo_pkg_ids(cur_repo, &first, &last);
+		snprintf(query, BUFSIZ, NEXT_REPO_PKG_ID, first, first, last);
+	} else
+		snprintf(query, BUFSIZ, NEXT_PKG_ID, sum.tbl_name);
+	if (pkgindb_doquery(query, pdb_get_value, buf) == PDB_OK)
+		pkgid = strtol(buf, (char **)NULL, 10);
+	else
+		pkgid = 1;
+
+	if (delta.on)
+		pkgindb_doquery("DELETE FROM REMOTE_SEEN;", NULL, NULL);
+
+	changes = pkgindb_changes();
+
+	for (; pd != NULL && pd->name != NULL; pd++)
+		npkgs++;
+
+	printf(MSG_UPDATING_DB);
+	fflush(stdout);
+	shown = 0;
+
+	parse_start(ld);
+
+	if (delta.on == DELTA_PATCH)
+		patch_removed(ld, summary, cur_repo, &delta);
+
+	/* installed packages, read by the parsers */
+	for (pd = pkgs; pd != NULL && pd->name != NULL; pd += b->npkgs) {
+		b = &parsers.batches[tail];
+		b->pkgs = pd;
+		while (b->npkgs < RECORDS_PER_BATCH &&
+			pd[b->npkgs].name != NULL)
+			b->npkgs++;
+
+		batch_push(&head, &tail, &pkgid, cur_repo, &delta);
+		progress((int)((pd - pkgs + b->npkgs) * 100 / npkgs));
+	}
+
+	/* main pkg_summary analysis loop */
+	while (summary != NULL) {
+		line = sum_getline(summary);
+		b = &parsers.batches[tail];
+
+		if (line != NULL && *line != '\0') {
+			record_add(b, line);
+			continue;
+		}
+
+		/* an empty line or the end of the summary closes the record */
+		if (b->len > b->off[b->nrec])
+			b->off[++b->nrec] = b->len;
+
+		if (b->nrec == RECORDS_PER_BATCH || (line == NULL && b->nrec > 0)) {
+			batch_push(&head, &tail, &pkgid, cur_repo, &delta);
+			/* bytes of the summary read so far */
+			progress(sum_progress(summary));
+		}
+
+		if (line == NULL)
+			break;
+	}
+
+	/* write remaining batches */
+	for (; head != tail; head = (head + 1) % PARSE_BATCHES)
+		batch_write(&parsers.batches[head], &pkgid, cur_repo, &delta);
+
+	parse_stop();
+
+	if (delta.on == DELTA_ON) {
+		/* packages which are not part of the summary anymore */
+		snprintf(query, BUFSIZ, COUNT_UNSEEN_REMOTE, first, last);
+		if (pkgindb_doquery(query, pdb_get_value, buf) == PDB_OK)
+			delta.removed = strtol(buf, (char **)NULL, 10);
+
+		/* REPO_PKG last, it is used by the search index subquery */
+		for (arr = &(sum.tbl_name) + 1; *arr != NULL; ++arr) {
+			snprintf(query, BUFSIZ, DELETE_UNSEEN_REMOTE, *arr,
+				first, last);
+			pkgindb_doquery(query, NULL, NULL);
+		}
+		if (ld->search != NULL) {
+			snprintf(query, BUFSIZ, DELETE_UNSEEN_SEARCH, first, last);
+			pkgindb_doquery(query, NULL, NULL);
+		}
+		snprintf(query, BUFSIZ, DELETE_UNSEEN_REMOTE,
+			sum.tbl_name, first, last);
+		pkgindb_doquery(query, NULL, NULL);
+	}
+
+	progress(100);
+
+	printf("\n");
+
+	stats.rows += pkgindb_changes() - changes;
+	stats.ingest_time += time_sec() - start;
+
+	if (delta.on)
+		printf(MSG_REMOTE_DELTA, delta.added, delta.changed, delta.removed);
+}
+
+static void
+delete_remote_tbl(struct Summary sum, char *repo)
+{
+	char		buf[BUFSIZ];
+	const char	**arr;
+	int			first, last;
+
+	/* the repository's PKG_ID range, in every table */
+	repo_pkg_ids(repo, &first, &last);
+
+	/* (REPO|LOCAL)_PKG is first -> skip */
+	for (arr = &(sum.tbl_name) + 1; *arr != NULL; ++arr) {
+		snprintf(buf, BUFSIZ, DELETE_REMOTE, *arr, first, last);
+		pkgindb_doquery(buf, NULL, NULL);
+	}
+
+	/* fails harmlessly without a search index */
+	snprintf(buf, BUFSIZ, DELETE_REMOTE_SEARCH, first, last);
+	pkgindb_doquery(buf, NULL, NULL);
+
+	snprintf(buf, BUFSIZ, DELETE_REMOTE, sum.tbl_name, first, last);
+	pkgindb_doquery(buf, NULL, NULL);
+}
+
+static int
+pdb_clean_remote(void *param, int argc, char **argv, char **colname)
+{
+	int	i;
+	size_t	repolen;
+	char	**repos = pkg_repos, query[BUFSIZ];
+
+	if (argv == NULL)
+		return PDB_ERR;
+
+	for (i = 0; repos[i] != NULL; i++) {
+		repolen = strlen(repos[i]);
+		if (repolen == strlen(argv[0]) &&
+			strncmp(repos[i], argv[0], repolen) == 0 && !force_update)
+		   	return PDB_OK;
+	}
+	/* did not find argv[0] (db repository) in pkg_repos */
+	printf(MSG_CLEANING_DB_FROM_REPO, argv[0]);
+
+	delete_remote_tbl(sumsw[REMOTE_SUMMARY], argv[0]);
+
+	snprintf(query, BUFSIZ,
+		"DELETE FROM REPOS WHERE REPO_URL = \'%s\';", argv[0]);
+	pkgindb_doquery(query, NULL, NULL);
+
+	/* force pkg_summary reload for available repository */
+	force_fetch = 1;
+
+	return PDB_OK;
+}
+
+/**
+ * \fn local_delta
+ *
+ * \brief compare the installed packages to their LOCAL_PKG snapshots,
+ * a changed +INSTALLED_INFO also has the package read again.
+ * Rows of removed or changed packages are deleted, the keep flags of the
+ * latter being saved to LOCAL_KEPT. pkgs is left with the packages which
+ * have to be read.
+ */
+static void
+local_delta(struct Loader *ld, struct Pkgdir *pkgs, int count)
+{
+	sqlite3_stmt	*snap, *kept;
+	const char		*name;
+	int				i = 0, n = 0, cmp = 1, ndel = 0, *del = NULL;
+
+	if ((snap = pkgindb_prepare(LOCAL_PKG_SNAPSHOT)) == NULL)
+		return;
+
+	/* both lists are sorted by name */
+	while (sqlite3_step(snap) == SQLITE_ROW) {
+		if ((name = (const char *)sqlite3_column_text(snap, 1)) == NULL)
+			name = "";
+
+		/* installed packages sorting before this row are new */
+		while (i < count && (cmp = strcmp(pkgs[i].name, name)) < 0)
+			pkgs[n++] = pkgs[i++];
+
+		if (i < count && cmp == 0) {
+			if (sqlite3_column_type(snap, 3) != SQLITE_NULL &&
+				sqlite3_column_int64(snap, 2) == pkgs[i].mtime &&
+				sqlite3_column_int64(snap, 3) == pkgs[i].inode &&
+				sqlite3_column_int64(snap, 4) == pkgs[i].info_mtime) {
+				/* unchanged, its rows stay as they are */
+				XFREE(pkgs[i].name);
+				i++;
+				continue;
+			}
+			pkgs[n++] = pkgs[i++];
+		}
+
+		/* changed or removed */
+		XREALLOC(del, (ndel + 1) * sizeof(int));
+		del[ndel++] = sqlite3_column_int(snap, 0);
+	}
+	pkgindb_finalize(&snap);
+
+	while (i < count)
+		pkgs[n++] = pkgs[i++];
+	pkgs[n].name = NULL;
+
+	pkgindb_doquery(CREATE_LOCAL_KEPT, NULL, NULL);
+	kept = pkgindb_prepare(INSERT_LOCAL_KEPT);
+
+	for (i = 0; i < ndel; i++) {
+		sqlite3_bind_int(kept, 1, del[i]);
+		pkgindb_step(kept);
+		delete_pkgid(ld, del[i]);
+	}
+
+	pkgindb_finalize(&kept);
+	XFREE(del);
+}
+
+/* commit an update transaction, timed for the statistics */
+static void
+update_commit(void)
+{
+	double	start = time_sec();
+
+	pkgindb_doquery("COMMIT;", NULL, NULL);
+
+	stats.commit_time += time_sec() - start;
+}
+
+/**
+ * \fn mark_automatic
+ *
+ * \brief mark plisthead's packages as automatic in pkgdb, and update
+ * their cached flag and +INSTALLED_INFO mtime in a single transaction so
+ * the next refresh doesn't read them again
+ */
+static void
+mark_automatic(Plisthead *plisthead)
+{
+	Pkglist			*pkglist;
+	sqlite3_stmt	*stmt;
+	struct stat		st;
+	char			path[BUFSIZ];
+
+	if ((stmt = pkgindb_prepare(UPDATE_LOCAL_AUTOMATIC)) == NULL)
+		return;
+
+	pkgindb_doquery("BEGIN;", NULL, NULL);
+
+	SLIST_FOREACH(pkglist, plisthead, next) {
+		if (mark_as_automatic_installed(pkglist->full, 1) < 0)
+			continue;
+
+		snprintf(path, BUFSIZ, "%s/%s/" INSTALLED_INFO_FNAME, pkgdb_dir,
+			pkglist->full);
+		if (stat(path, &st) < 0)
+			continue;
+
+		sqlite3_bind_int64(stmt, 1, (int64_t)st.st_mtime);
+		sqlite3_bind_text(stmt, 2, pkglist->full, -1, SQLITE_STATIC);
+		pkgindb_step(stmt);
+	}
+
+	update_commit();
+	pkgindb_finalize(&stmt);
+}
+
+/**
+ * \fn update_localdb
+ *
+ * \brief refresh LOCAL_* tables, only the packages which were installed,
+ * removed or replaced since the last refresh are read and written
+ */
 static void
 update_localdb(char **pkgkeep)
 {
-	char		**summary = NULL, buf[BUFSIZ];
-	Plisthead	*keeplisthead, *nokeeplisthead;
-	Pkglist		*pkglist;
+	struct Pkgdir	*pkgs;
+	Plisthead		*plisthead;
+	char			query[BUFSIZ], buf[BUFSIZ];
+	int				count, first;
+	uint8_t			had_keep;
 
-	/* has the pkgdb (pkgsrc) changed ? if not, continue */
-	if (!pkg_db_mtime() || !pkgdb_open(ReadWrite))
+	if (!pkgdb_open(ReadWrite))
 		return;
 
 	/* just checking */
 	pkgdb_close();
 
-	/* record the keep list */
-	keeplisthead = rec_pkglist(KEEP_LOCAL_PKGS);
-	/* delete local pkg table (faster than updating) */
-	pkgindb_doquery(DELETE_LOCAL, NULL, NULL);
-
 	printf(MSG_READING_LOCAL_SUMMARY);
-	/* generate summary locally */
-	summary = exec_list(PKGTOOLS "/pkg_info -Xa", NULL);
+	/* packages metadata are read from PKG_DBDIR by the parsers */
+	count = list_pkgdb(&pkgs);
 
 	printf(MSG_PROCESSING_LOCAL_SUMMARY);
 
+	pkgindb_doquery("BEGIN;", NULL, NULL);
+
+	buf[0] = '\0';
+	pkgindb_doquery(COUNT_KEEP_LOCAL, pdb_get_value, buf);
+	had_keep = strtol(buf, (char **)NULL, 10) > 0;
+
+	local_delta(loader_prepare(sumsw[LOCAL_SUMMARY]), pkgs, count);
+
+	/* rows from first are the ones inserted by this refresh */
+	snprintf(query, BUFSIZ, NEXT_PKG_ID, sumsw[LOCAL_SUMMARY].tbl_name);
+	if (pkgindb_doquery(query, pdb_get_value, buf) == PDB_OK)
+		first = strtol(buf, (char **)NULL, 10);
+	else
+		first = 1;
+
 	/* insert the summary to the database */
-	insert_summary(sumsw[LOCAL_SUMMARY], summary, NULL);
+	insert_summary(sumsw[LOCAL_SUMMARY], NULL, pkgs, NULL, 0, PROFILE_FULL);
+
+	/* replaced packages keep their flag */
+	snprintf(query, BUFSIZ, RESTORE_LOCAL_KEPT, first);
+	pkgindb_doquery(query, NULL, NULL);
+
+	/*
+	 * no packages are marked as keep in pkgin's db, probably a fresh
+	 * install or a rebuild: restore keep flags from the automatic
+	 * flags the parsers read from pkgdb
+	 */
+	if (!had_keep) {
+		snprintf(query, BUFSIZ, KEEP_NEW_MANUAL_LOCAL, first);
+		pkgindb_doquery(query, NULL, NULL);
+	}
+
+	update_commit();
+
+	free_pkgdirs(pkgs);
 
 	/* re-read local packages list as it may have changed */
 	free_global_pkglists();
 	init_global_pkglists();
 
-	/* restore keep-list */
-	if (keeplisthead != NULL) {
-		SLIST_FOREACH(pkglist, keeplisthead, next) {
-			snprintf(buf, BUFSIZ, KEEP_PKG, pkglist->name);
-			pkgindb_doquery(buf, NULL, NULL);
-		}
-		free_pkglist(&keeplisthead, LIST);
-
-		/*
-		 * packages are installed "manually" by pkgin_install()
-		 * they are recorded as "non-automatic" in pkgdb, we
-		 * need to mark unkeeps as "automatic"
-		 */
-		if ((nokeeplisthead =
-				rec_pkglist(NOKEEP_LOCAL_PKGS)) != NULL) {
-			SLIST_FOREACH(pkglist, nokeeplisthead, next)
-				mark_as_automatic_installed(pkglist->full, 1);
-
-			free_pkglist(&nokeeplisthead, LIST);
-		}
-	} else { /* empty keep list */
-		/*
-		 * no packages are marked as keep in pkgin's db
-		 * probably a fresh install or a rebuild
-		 * restore keep flags with pkgdb informations
-		 */
-		SLIST_FOREACH(pkglist, &l_plisthead, next) {
-			if (!is_automatic_installed(pkglist->full)) {
-				snprintf(buf, BUFSIZ, KEEP_PKG, pkglist->name);
-				pkgindb_doquery(buf, NULL, NULL);
-			}
-		}
+	/*
+	 * packages are installed "manually" by pkgin_install()
+	 * they are recorded as "non-automatic" in pkgdb, we
+	 * need to mark new unkeeps as "automatic"
+	 */
+	if (had_keep &&
+		(plisthead = rec_pkglist(NEW_MANUAL_LOCAL_PKGS, first)) != NULL) {
+		mark_automatic(plisthead);
+		free_pkglist(&plisthead, LIST);
 	}
 
 	/* insert new keep list if there's any */
 	if (pkgkeep != NULL)
 		/* installation: mark the packages as "keep" */
 		pkg_keep(KEEP, pkgkeep);
+}
+
+/**
+ * \fn fetch_worker
+ *
+ * \brief pick repositories from the pool until there are none left,
+ * each fetch uses its own connection
+ */
+static void *
+fetch_worker(void *arg)
+{
+	struct Fetchjob	*job;
+	Sumstream		*summary;
+
+	for (;;) {
+		pthread_mutex_lock(&pool.lock);
+		if (pool.next == pool.njobs) {
+			pthread_mutex_unlock(&pool.lock);
+			break;
+		}
+		job = &pool.jobs[pool.next++];
+		pthread_mutex_unlock(&pool.lock);
+
+		if (job->fresh)
+			continue;
+
+		summary = fetch_summary(job);
+		if (summary != NULL)
+			summary = sum_spool(summary);
+
+		pthread_mutex_lock(&pool.lock);
+		job->summary = summary;
+		job->done = 1;
+		pthread_cond_broadcast(&pool.cond);
+		pthread_mutex_unlock(&pool.lock);
+	}
 
-	free_list(summary);
+	return NULL;
 }
 
-static void
-update_remotedb(void)
+/**
+ * \fn fetch_all
+ *
+ * \brief start fetching every repository summary, the first one excepted
+ * if it is the only one: it is then streamed directly by insert_summary(),
+ * unless spool is set because the local refresh runs first
+ */
+static int
+fetch_all(pthread_t *workers, uint8_t spool)
+{
+	int		i, e, nworkers, pending = 0, first, last;
+	char	query[BUFSIZ], buf[BUFSIZ];
+	time_t	now = time(NULL);
+
+	init_sumexts();
+
+	for (pool.njobs = 0; pkg_repos[pool.njobs] != NULL; pool.njobs++);
+
+	XMALLOC(pool.jobs, pool.njobs * sizeof(struct Fetchjob));
+	memset(pool.jobs, 0, pool.njobs * sizeof(struct Fetchjob));
+	pool.next = 0;
+
+	for (i = 0; i < pool.njobs; i++) {
+		pool.jobs[i].repo = pkg_repos[i];
+		pool.jobs[i].profile = (uint8_t)repo_profiles[i];
+
+		/* loaded with another profile: reloaded as if forced */
+		snprintf(query, BUFSIZ, REPO_PROFILE, pkg_repos[i]);
+		buf[0] = '\0';
+		pkgindb_doquery(query, pdb_get_value, buf);
+		pool.jobs[i].reload = force_fetch || force_update ||
+			strtol(buf, (char **)NULL, 10) != repo_profiles[i];
+
+		/* replaced packages get new PKG_ID, renumber a half used range */
+		repo_pkg_ids(pkg_repos[i], &first, &last);
+		snprintf(query, BUFSIZ, NEXT_REPO_PKG_ID, first, first, last);
+		buf[0] = '\0';
+		pkgindb_doquery(query, pdb_get_value, buf);
+		if (strtol(buf, (char **)NULL, 10) - first > (last - first) / 2)
+			pool.jobs[i].reload = 1;
+
+		if (!pool.jobs[i].reload) {
+			pool.jobs[i].sum_mtime = pkg_sum_mtime(pkg_repos[i]);
+			pkg_sum_ext(pkg_repos[i], pool.jobs[i].sumext);
+			/* only if still supported and enabled */
+			for (e = 0; sumexts[e] != NULL; e++)
+				if (strcmp(sumexts[e], pool.jobs[i].sumext) == 0)
+					break;
+			if (sumexts[e] == NULL)
+				pool.jobs[i].sumext[0] = '\0';
+
+			/* generation of its packages list, for deltas */
+			snprintf(query, BUFSIZ, REPO_GEN, pkg_repos[i]);
+			buf[0] = '\0';
+			pkgindb_doquery(query, pdb_get_value, buf);
+			if (valid_gen(buf))
+				strlcpy(pool.jobs[i].gen, buf, SMLLEN);
+
+			/* checked less than its TTL ago: no request at all */
+			snprintf(query, BUFSIZ, REPO_FRESH, pkg_repos[i],
+				(long long)now);
+			buf[0] = '\0';
+			pkgindb_doquery(query, pdb_get_value, buf);
+			if (strtol(buf, (char **)NULL, 10) > 0) {
+				pool.jobs[i].fresh = 1;
+				pool.jobs[i].done = 1;
+				continue;
+			}
+		} else
+			pool.jobs[i].sum_mtime = 0; /* 0 sumtime == force reload */
+
+		pending++;
+	}
+
+	if (pending == 0 || (pending < 2 && !spool))
+		return 0;
+
+	nworkers = pending < MAX_FETCH_WORKERS ? pending : MAX_FETCH_WORKERS;
+
+	for (i = 0; i < nworkers; i++)
+		if (pthread_create(&workers[i], NULL, fetch_worker, NULL) != 0)
+			break;
+
+	/* no thread at all, fetch serially from the main thread */
+	if (i == 0)
+		fetch_worker(NULL);
+
+	return i;
+}
+
+/* wait for a repository summary, fetching it now if there's no pool */
+static Sumstream *
+fetch_wait(struct Fetchjob *job, int nworkers)
+{
+	if (nworkers == 0 && !job->done) {
+		job->summary = fetch_summary(job);
+		job->done = 1;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	while (!job->done)
+		pthread_cond_wait(&pool.cond, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+
+	return job->summary;
+}
+
+/**
+ * \fn fetch_running
+ *
+ * \brief whether summaries are being fetched, from remote_start() until
+ * update_remotedb() has joined its workers. Main thread only.
+ */
+int
+fetch_running(void)
+{
+	return pool.njobs > 0;
+}
+
+/**
+ * \fn remote_start
+ *
+ * \brief record the repositories and start fetching their summaries,
+ * which goes on while the local refresh is written
+ */
+static int
+remote_start(pthread_t *workers, uint8_t local)
 {
-	char	**summary = NULL, **prepos;
+	int		i;
+	char	query[BUFSIZ];
 
 	/* delete unused repositories */
 	pkgindb_doquery("SELECT REPO_URL FROM REPOS;",
 		pdb_clean_remote, NULL);
+	/* a forced update cleaned them all, record them back */
+	repo_record(pkg_repos);
+
+	/* TTLs and order come from the configuration, see split_repos() */
+	for (i = 0; pkg_repos[i] != NULL; i++) {
+		snprintf(query, BUFSIZ, UPDATE_REPO_TTL, repo_ttls[i],
+			pkg_repos[i]);
+		pkgindb_doquery(query, NULL, NULL);
+		snprintf(query, BUFSIZ, UPDATE_REPO_RANK, i, pkg_repos[i]);
+		pkgindb_doquery(query, NULL, NULL);
+	}
+
+	return fetch_all(workers, local);
+}
+
+/**
+ * \fn repo_gen
+ *
+ * \brief generation of repo's packages list: the sum of its record
+ * hashes, as mkdelta computes it from a summary. Empty if a hash is
+ * missing. The attached catalog's if repo is NULL.
+ */
+static void
+repo_gen(const char *repo, char *gen)
+{
+	sqlite3_stmt	*stmt;
+	uint64_t		sum = 0;
+	int				first, last;
+
+	gen[0] = '\0';
+
+	stmt = pkgindb_prepare(repo != NULL ? REPO_PKG_HASHES :
+		CATALOG_PKG_HASHES);
+	if (stmt == NULL)
+		return;
+
+	if (repo != NULL) {
+		repo_pkg_ids(repo, &first, &last);
+		sqlite3_bind_int(stmt, 1, first);
+		sqlite3_bind_int(stmt, 2, last);
+	}
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		if (sqlite3_column_type(stmt, 0) == SQLITE_NULL) {
+			pkgindb_finalize(&stmt);
+			return;
+		}
+		sum += (uint64_t)sqlite3_column_int64(stmt, 0);
+	}
+	pkgindb_finalize(&stmt);
+
+	snprintf(gen, SMLLEN, "%016llx", (unsigned long long)sum);
+}
 
+/**
+ * \fn import_summary
+ *
+ * \brief replace job's repository entries in a single transaction,
+ * returns 0 if summary is a delta which didn't lead to the generation
+ * announced, it is then rolled back
+ */
+static int
+import_summary(struct Fetchjob *job, Sumstream *summary)
+{
+	uint8_t	delta;
+	char	query[BUFSIZ], gen[SMLLEN];
+
+	printf(job->patch ? MSG_PROCESSING_REMOTE_DELTA :
+		MSG_PROCESSING_REMOTE_SUMMARY, job->repo);
+
+	/* outside of the transaction, which may be rolled back */
+	pkgindb_doquery(CREATE_REMOTE_SEEN, NULL, NULL);
+
+	pkgindb_doquery("BEGIN;", NULL, NULL);
+
+	/*
+	 * forced update: delete remote* associated to this repository,
+	 * else only apply the differences with the new summary
+	 */
+	if (job->patch)
+		delta = DELTA_PATCH;
+	else if (!job->reload)
+		delta = DELTA_ON;
+	else {
+		delta = DELTA_OFF;
+		delete_remote_tbl(sumsw[REMOTE_SUMMARY], job->repo);
+	}
+	/* update remote* table for this repository */
+	insert_summary(sumsw[REMOTE_SUMMARY], summary, NULL, job->repo, delta,
+		job->profile);
+
+	sum_stats(summary, &stats.sum);
+
+	/* only needed for a repository announcing generations */
+	gen[0] = '\0';
+	if (*job->to != '\0')
+		repo_gen(job->repo, gen);
+	if (job->patch && strcmp(gen, job->to) != 0) {
+		pkgindb_doquery("ROLLBACK;", NULL, NULL);
+		return 0;
+	}
+	/* a summary newer than the generation file, checked next time */
+	if (strcmp(gen, job->to) != 0)
+		gen[0] = '\0';
+
+	/* only record summary mtime once it has been fully read */
+	if (!job->patch) {
+		snprintf(query, BUFSIZ, UPDATE_REPO_MTIME,
+			(long long)job->sum_mtime, job->sumext, job->repo);
+		pkgindb_doquery(query, NULL, NULL);
+	}
+	snprintf(query, BUFSIZ, UPDATE_REPO_GEN, gen, job->repo);
+	pkgindb_doquery(query, NULL, NULL);
+	snprintf(query, BUFSIZ, UPDATE_REPO_PROFILE, job->profile, job->repo);
+	pkgindb_doquery(query, NULL, NULL);
+	snprintf(query, BUFSIZ, UPDATE_REPO_CHECKED,
+		(long long)time(NULL), job->repo);
+	pkgindb_doquery(query, NULL, NULL);
+
+	update_commit();
+
+	return 1;
+}
+
+/*
+ * copy repo's partition to the attached catalog or, when importing, the
+ * catalog's rows to repo's emptied partition. Catalog PKG_ID are
+ * numbered from 1. The columns are the ones of this database: a catalog
+ * missing one of them is refused, extra ones are ignored. A PROFILE_SLIM
+ * import only copies the main table columns it keeps, and indexes names
+ * and comments only.
+ */
+static int
+copy_catalog(struct Summary sum, const char *repo, uint8_t import,
+	uint8_t profile)
+{
+	struct Columns	cols;
+	const char		**arr;
+	char			query[BUFSIZ], names[BUFSIZ], exprs[BUFSIZ], col[BUFSIZ];
+	int				i, first, last, rc = PDB_OK;
+
+	memset(&cols, 0, sizeof(cols));
+
+	repo_pkg_ids(repo, &first, &last);
+
+	for (arr = &(sum.tbl_name); *arr != NULL && rc == PDB_OK; ++arr) {
+		snprintf(query, BUFSIZ, "PRAGMA main.table_info(%s);", *arr);
+		pkgindb_doquery(query, colnames, &cols);
+
+		names[0] = exprs[0] = '\0';
+		for (i = 0; i < cols.num; i++) {
+			/* children rows are numbered by the database */
+			snprintf(col, BUFSIZ, "%s_ID", *arr);
+			if (import && strcmp(cols.name[i], col) == 0)
+				continue;
+			if (import && profile == PROFILE_SLIM &&
+				arr == &(sum.tbl_name) && !slim_col(cols.name[i]))
+				continue;
+
+			if (strcmp(cols.name[i], "PKG_ID") == 0)
+				snprintf(col, BUFSIZ, "PKG_ID %c %d", import ? '+' : '-',
+					first);
+			else if (import && strcmp(cols.name[i], "REPOSITORY") == 0)
+				snprintf(col, BUFSIZ, "'%s'", repo);
+			else
+				strlcpy(col, cols.name[i], BUFSIZ);
+
+			if (*names != '\0') {
+				strlcat(names, ",", BUFSIZ);
+				strlcat(exprs, ",", BUFSIZ);
+			}
+			strlcat(names, cols.name[i], BUFSIZ);
+			strlcat(exprs, col, BUFSIZ);
+		}
+		freecols(&cols);
+
+		if (import)
+			snprintf(query, BUFSIZ, IMPORT_CATALOG_TBL,
+				*arr, names, exprs, *arr);
+		else
+			snprintf(query, BUFSIZ, EXPORT_CATALOG_TBL,
+				*arr, names, exprs, *arr, first, last);
+		rc = pkgindb_doquery(query, NULL, NULL);
+	}
+
+	/* full-text index, if this database has one */
+	if (rc == PDB_OK &&
+		pkgindb_doquery("SELECT name FROM main.sqlite_master "
+			"WHERE name = 'REMOTE_SEARCH';", pdb_get_value, col) == PDB_OK) {
+		if (import)
+			snprintf(query, BUFSIZ, profile == PROFILE_SLIM ?
+				IMPORT_CATALOG_SEARCH_SLIM : IMPORT_CATALOG_SEARCH, first);
+		else
+			snprintf(query, BUFSIZ, EXPORT_CATALOG_SEARCH, first, first);
+		rc = pkgindb_doquery(query, NULL, NULL);
+	}
+
+	return rc;
+}
+
+/**
+ * \fn import_catalog
+ *
+ * \brief replace job's repository entries by the ones of its prebuilt
+ * catalog, in a single transaction. Returns 0 if the catalog can't be
+ * used: not a database, another CATALOG_VERSION, packages not matching
+ * its generation, a generation other than the one the repository
+ * announces for its summary, or missing columns. The database is then
+ * untouched.
+ */
+static int
+import_catalog(struct Fetchjob *job, Sumstream *summary)
+{
+	sqlite3_stmt	*stmt;
+	FILE			*fp;
+	size_t			n;
+	int				version = 0, npkgs = 0, changes, rc;
+	char			buf[BUFSIZ], query[BUFSIZ], gen[SMLLEN], catgen[SMLLEN];
+	const char		*val;
+
+	printf(MSG_PROCESSING_REMOTE_CATALOG, job->repo);
+
+	/* SQLite attaches files */
+	if ((fp = fopen(PDB_CATALOG, "w")) == NULL)
+		err(EXIT_FAILURE, MSG_CANT_OPEN_WRITE, PDB_CATALOG);
+	while ((n = sum_read(summary, buf, BUFSIZ)) > 0)
+		if (fwrite(buf, 1, n, fp) != n)
+			err(EXIT_FAILURE, "can't write %s", PDB_CATALOG);
+	if (fclose(fp) != 0)
+		err(EXIT_FAILURE, "can't write %s", PDB_CATALOG);
+
+	sum_stats(summary, &stats.sum);
+
+	if (pkgindb_attach(PDB_CATALOG, 0) != PDB_OK) {
+		(void)unlink(PDB_CATALOG);
+		return 0;
+	}
+
+	catgen[0] = '\0';
+	if ((stmt = pkgindb_prepare(CATALOG_INFO)) != NULL) {
+		if (sqlite3_step(stmt) == SQLITE_ROW) {
+			version = sqlite3_column_int(stmt, 0);
+			if ((val = (const char *)sqlite3_column_text(stmt, 1)) != NULL)
+				strlcpy(catgen, val, SMLLEN);
+			npkgs = sqlite3_column_int(stmt, 2);
+		}
+		pkgindb_finalize(&stmt);
+	}
+
+	/*
+	 * its packages are the ones it was built with, from the summary the
+	 * repository currently publishes
+	 */
+	repo_gen(NULL, gen);
+	rc = version == CATALOG_VERSION && valid_gen(catgen) &&
+		strcmp(gen, catgen) == 0 && strcmp(catgen, job->to) == 0;
+
+	if (rc) {
+		changes = pkgindb_changes();
+
+		pkgindb_doquery("BEGIN;", NULL, NULL);
+
+		delete_remote_tbl(sumsw[REMOTE_SUMMARY], job->repo);
+
+		rc = copy_catalog(sumsw[REMOTE_SUMMARY], job->repo, 1,
+			job->profile) == PDB_OK;
+
+		if (rc) {
+
+			snprintf(query, BUFSIZ, UPDATE_REPO_MTIME,
+				(long long)job->sum_mtime, job->sumext, job->repo);
+			pkgindb_doquery(query, NULL, NULL);
+			snprintf(query, BUFSIZ, UPDATE_REPO_GEN, gen, job->repo);
+			pkgindb_doquery(query, NULL, NULL);
+			snprintf(query, BUFSIZ, UPDATE_REPO_PROFILE, job->profile,
+				job->repo);
+			pkgindb_doquery(query, NULL, NULL);
+			snprintf(query, BUFSIZ, UPDATE_REPO_CHECKED,
+				(long long)time(NULL), job->repo);
+			pkgindb_doquery(query, NULL, NULL);
+
+			update_commit();
+
+			stats.rows += pkgindb_changes() - changes;
+		} else
+			pkgindb_doquery("ROLLBACK;", NULL, NULL);
+	}
+
+	pkgindb_detach();
+	(void)unlink(PDB_CATALOG);
+
+	if (rc)
+		printf(MSG_CATALOG_PKGS, npkgs);
+
+	return rc;
+}
+
+/**
+ * \fn update_remotedb
+ *
+ * \brief import the summaries fetched by remote_start()'s workers
+ */
+static void
+update_remotedb(pthread_t *workers, int nworkers)
+{
+	Sumstream	*summary;
+	struct Fetchjob	*job;
+	int			i;
+	uint8_t		shadowed = 0;
+	char		query[BUFSIZ];
+
+	/*
+	 * summaries are fetched and decompressed concurrently, the
+	 * database import is done here, one repository at a time
+	 */
 	/* loop through PKG_REPOS */
-	for (prepos = pkg_repos; *prepos != NULL; prepos++) {
+	for (job = pool.jobs; job < pool.jobs + pool.njobs; job++) {
+		/* open remote pkg_summary */
+		summary = fetch_wait(job, nworkers);
 
-		/* load remote pkg_summary */
-		if ((summary = fetch_summary(*prepos)) == NULL) {
-			printf(MSG_DB_IS_UP_TO_DATE, *prepos);
+		/*
+		 * the first import switches to a copy of the database, not
+		 * needed while every repository is up-to-date. Statements
+		 * were compiled against the current one.
+		 */
+		if (summary != NULL && !shadowed) {
+			loader_finalize();
+			pkgindb_shadow();
+			shadowed = 1;
+		}
+
+		/* an unusable delta or catalog: fetch again, unconditionally */
+		while (summary != NULL && (job->patch || job->catalog)) {
+			if (job->catalog ? import_catalog(job, summary) :
+				import_summary(job, summary))
+				break;
+
+			printf(job->catalog ? MSG_CATALOG_REJECTED :
+				MSG_DELTA_MISMATCH, job->repo);
+			sum_close(summary);
+			job->no_catalog |= job->catalog;
+			job->patch = job->catalog = 0;
+			job->gen[0] = '\0';
+			job->sum_mtime = 0;
+			summary = job->summary = fetch_summary(job);
+		}
+
+		if (summary == NULL) {
+			if (job->unreachable) {
+				/* not checked, tried again next time */
+				fprintf(stderr, MSG_REPO_UNREACHABLE, job->repo);
+				continue;
+			}
+			/* a check which found it up-to-date restarts its TTL */
+			if (job->sum_mtime < 0) {
+				snprintf(query, BUFSIZ, UPDATE_REPO_CHECKED,
+					(long long)time(NULL), job->repo);
+				pkgindb_doquery(query, NULL, NULL);
+			}
+			printf(MSG_DB_IS_UP_TO_DATE, job->repo);
 			continue;
 		}
 
-		printf(MSG_PROCESSING_REMOTE_SUMMARY, *prepos);
+		if (!job->patch && !job->catalog)
+			(void)import_summary(job, summary);
 
-		/* delete remote* associated to this repository */
-		delete_remote_tbl(sumsw[REMOTE_SUMMARY], *prepos);
-		/* update remote* table for this repository */
-		insert_summary(sumsw[REMOTE_SUMMARY], summary, *prepos);
+		sum_close(summary);
+		job->summary = NULL;
 	}
 
+	for (i = 0; i < nworkers; i++)
+		pthread_join(workers[i], NULL);
+
+	XFREE(pool.jobs);
+	pool.njobs = 0;
+
 	/* remove empty rows (duplicates) */
 	pkgindb_doquery(DELETE_EMPTY_ROWS, NULL, NULL);
+}
+
+/**
+ * \fn show_stats
+ *
+ * \brief print what each phase of the update did, and how fast
+ */
+static void
+show_stats(void)
+{
+	double	mb = (double)stats.sum.size / (1024 * 1024);
+	double	decomp = stats.sum.fill_time - stats.sum.fetch_time;
+
+	if (stats.records == 0 && stats.sum.fetched == 0)
+		return;
 
-	free_list(summary);
+	if (stats.sum.fetched > 0)
+		printf(MSG_STATS_FETCH, (double)stats.sum.fetched / (1024 * 1024),
+			stats.sum.fetch_time);
+	/* uncompressed summaries only have a transfer time */
+	if (stats.sum.size > stats.sum.fetched && decomp > 0)
+		printf(MSG_STATS_DECOMP, mb, decomp, mb / decomp);
+	printf(MSG_STATS_PARSE, stats.records, stats.ingest_time,
+		stats.ingest_time > 0 ? stats.records / stats.ingest_time : 0);
+	printf(MSG_STATS_WRITE, stats.rows, stats.commit_time);
 }
 
 int
 update_db(int which, char **pkgkeep)
 {
+	pthread_t	workers[MAX_FETCH_WORKERS];
+	int			nworkers = 0;
+	uint8_t		local;
+
 	if (!have_enough_rights())
 		return EXIT_FAILURE;
 
-	/* always check for LOCAL_SUMMARY updates */
-	update_localdb(pkgkeep);
+	memset(&stats, 0, sizeof(stats));
+
+	/*
+	 * other writers wait until the database is up-to-date, imports of
+	 * remote summaries being written to a copy of it, see
+	 * update_remotedb()
+	 */
+	pkgindb_lock();
+
+	/* always check for LOCAL_SUMMARY updates: has the pkgdb changed ? */
+	local = pkg_db_mtime();
 
+	/*
+	 * summaries are transferred by the fetch workers while the local
+	 * refresh is read and written, the main thread being the only
+	 * database writer
+	 */
 	if (which == REMOTE_SUMMARY)
-		update_remotedb();
+		nworkers = remote_start(workers, local);
 
-	/* columns name not needed anymore */
-	if (cols.name != NULL) {
-		/* reset colums count */
-		colcount = 0;
-		freecols();
-	}
+	if (local)
+		update_localdb(pkgkeep);
+
+	if (which == REMOTE_SUMMARY)
+		update_remotedb(workers, nworkers);
+
+	/* statements and columns name not needed anymore */
+	loader_finalize();
+
+	/* which replaces the current one once complete */
+	if (which == REMOTE_SUMMARY)
+		pkgindb_swap();
+	pkgindb_unlock();
+
+	if (verbosity)
+		show_stats();
 
 	return EXIT_SUCCESS;
 }
 
+/**
+ * \fn export_catalog
+ *
+ * \brief write the packages list of the only repository to path, for the
+ * repository to publish as PKG_CATALOG: clients then attach it instead
+ * of parsing the summary, see import_catalog()
+ *
+ * path is written aside and renamed once complete. It should be built
+ * again whenever the summary changes.
+ */
+void
+export_catalog(const char *path)
+{
+	char	*repo = pkg_repos[0];
+	char	tmp[BUFSIZ], query[BUFSIZ], gen[SMLLEN], buf[BUFSIZ];
+
+	if (repo == NULL || pkg_repos[1] != NULL)
+		errx(EXIT_FAILURE, MSG_CATALOG_ONE_REPO);
+	if (repo_profiles[0] != PROFILE_FULL)
+		errx(EXIT_FAILURE, MSG_CATALOG_SLIM, repo);
+
+	/* clients check the catalog against it */
+	repo_gen(repo, gen);
+	if (*gen == '\0')
+		errx(EXIT_FAILURE, MSG_CATALOG_NO_GEN, repo);
+
+	snprintf(tmp, BUFSIZ, "%s.tmp", path);
+	if (pkgindb_attach(tmp, 1) != PDB_OK)
+		errx(EXIT_FAILURE, "could not create %s", tmp);
+
+	pkgindb_doquery("BEGIN;", NULL, NULL);
+
+	if (copy_catalog(sumsw[REMOTE_SUMMARY], repo, 0, PROFILE_FULL) != PDB_OK) {
+		pkgindb_doquery("ROLLBACK;", NULL, NULL);
+		pkgindb_detach();
+		(void)unlink(tmp);
+		errx(EXIT_FAILURE, "could not write %s", tmp);
+	}
+
+	snprintf(query, BUFSIZ, INSERT_CATALOG_INFO, CATALOG_VERSION, gen,
+		(long long)time(NULL));
+	pkgindb_doquery(query, NULL, NULL);
+
+	pkgindb_doquery("COMMIT;", NULL, NULL);
+
+	buf[0] = '\0';
+	pkgindb_doquery("SELECT CATALOG_PKGS FROM catalog.CATALOG_INFO;",
+		pdb_get_value, buf);
+
+	pkgindb_detach();
+
+	if (rename(tmp, path) < 0)
+		err(EXIT_FAILURE, "can't rename %s to %s", tmp, path);
+
+	printf(MSG_CATALOG_WRITTEN, path, (int)strtol(buf, (char **)NULL, 10),
+		gen);
+}
+
 void
 split_repos(void)
 {
 	int		repocount;
-	char	*p;
+	long	ttl;
+	char	*p, *tok, *end;
 
 	XSTRDUP(env_repos, getenv("PKG_REPOS"));
 
@@ -702,19 +2773,40 @@ split_repos(void)
 		if ((env_repos = read_repos()) == NULL)
 			errx(EXIT_FAILURE, MSG_MISSING_PKG_REPOS);
 
-	repocount = 2; /* 1st elm + NULL */
+	repocount = 1; /* NULL */
 
 	XMALLOC(pkg_repos, repocount * sizeof(char *));
-	*pkg_repos = env_repos;
-
-	p = env_repos;
-
-	while((p = strchr(p, ' ')) != NULL) {
-		*p = '\0';
-		p++;
+	XMALLOC(repo_ttls, repocount * sizeof(int));
+	XMALLOC(repo_profiles, repocount * sizeof(int));
+
+	for (p = env_repos; (tok = strsep(&p, " ")) != NULL;) {
+		/* "ttl=seconds" applies to the repository before it */
+		if (strncmp(tok, "ttl=", 4) == 0 && repocount > 1) {
+			ttl = strtol(tok + 4, &end, 10);
+			if (end == tok + 4 || *end != '\0' || ttl < 0 ||
+				ttl > INT_MAX)
+				warnx(MSG_INVALID_TTL, pkg_repos[repocount - 2], tok);
+			else
+				repo_ttls[repocount - 2] = (int)ttl;
+			continue;
+		}
+		/* so is "profile=slim" or "profile=full" */
+		if (strncmp(tok, "profile=", 8) == 0 && repocount > 1) {
+			if (strcmp(tok + 8, "slim") == 0)
+				repo_profiles[repocount - 2] = PROFILE_SLIM;
+			else if (strcmp(tok + 8, "full") == 0)
+				repo_profiles[repocount - 2] = PROFILE_FULL;
+			else
+				warnx(MSG_INVALID_PROFILE, pkg_repos[repocount - 2], tok);
+			continue;
+		}
 
 		XREALLOC(pkg_repos, ++repocount * sizeof(char *));
-		pkg_repos[repocount - 2] = p;
+		XREALLOC(repo_ttls, repocount * sizeof(int));
+		XREALLOC(repo_profiles, repocount * sizeof(int));
+		pkg_repos[repocount - 2] = tok;
+		repo_ttls[repocount - 2] = 0;
+		repo_profiles[repocount - 2] = PROFILE_FULL;
 	}
 
 	/* NULL last element */
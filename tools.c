@@ -95,6 +95,32 @@ splitstr(char *str, const char *sep)
 	return(split);
 }
 
+/* FNV-1a hash of a buffer */
+uint64_t
+str_hash(const char *buf, size_t len)
+{
+	uint64_t	h = 0xcbf29ce484222325ULL;
+	size_t		i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)buf[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+/* current time in seconds, for statistics */
+double
+time_sec(void)
+{
+	struct timeval	tv;
+
+	gettimeofday(&tv, NULL);
+
+	return (double)tv.tv_sec + (double)tv.tv_usec / 1000000;
+}
+
 void
 free_list(char **list)
 {
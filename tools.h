@@ -65,6 +65,9 @@
 #if HAVE_SYS_STAT_H
 #include <sys/stat.h>
 #endif
+#if HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
 #if HAVE_ERR_H
 #include <err.h>
 #endif
@@ -202,6 +205,8 @@ extern int charcount(char *, char);
 extern int trimcr(char *);
 extern char **splitstr(char *, const char *);
 extern void free_list(char **);
+extern uint64_t str_hash(const char *, size_t);
+extern double time_sec(void);
 extern int min(int, int);
 extern int max(int, int);
 extern int listlen(const char **);